@@ -0,0 +1,298 @@
+/* Headless benchmark: replays IRC traffic through the client's parser,
+ * handlers and scrollback and, with -r, onto an offscreen terminal. */
+#define BENCH
+#include "irc.c"
+
+#include <sys/resource.h>
+
+enum {
+    Frame = 1000, /* Messages between screen updates with -r. */
+    NChan = 50,
+    NNick = 500,
+};
+
+struct Gen {
+    const char *name;
+    void (*fn)(struct Lane *, int);
+};
+
+static unsigned long rs = 88172645463325252UL;
+
+static unsigned long
+rnd(void)
+{
+    rs ^= rs << 13;
+    rs ^= rs >> 7;
+    rs ^= rs << 17;
+    return rs;
+}
+
+static void
+addf(struct Lane *b, const char *fmt, ...)
+{
+    char l[LineLen + 2];
+    va_list vl;
+    int n;
+
+    va_start(vl, fmt);
+    n = vsnprintf(l, LineLen - 1, fmt, vl);
+    va_end(vl);
+    if (n > LineLen - 2)
+        n = LineLen - 2;
+    l[n++] = '\r';
+    l[n++] = '\n';
+    lpush(b, l, n);
+}
+
+static void
+words(char *s, size_t n, const char *const *w, int nw)
+{
+    size_t i = 0, k;
+
+    for (s[0] = 0; i + 32 < n;) {
+        k = snprintf(s + i, n - i, "%s ", w[rnd() % nw]);
+        i += k;
+        if (rnd() % 8 == 0)
+            break;
+    }
+}
+
+static void
+genmsg(struct Lane *b, int n)
+{
+    static const char *const w[] = {"the", "quick", "brown", "fox", "jumps",
+        "over", "lazy", "dog", "irc", "client", "bench", "patch", "merge",
+        "review", "https://example.org/some/long/path?q=1", "lgtm", "ok"};
+    char t[400];
+    int i, u;
+
+    for (i = 0; i < n; i++) {
+        u = rnd() % NNick;
+        words(t, 32 + rnd() % (sizeof t - 32), w, sizeof w / sizeof *w);
+        addf(b, ":nick%d!~u%d@host%d.example.org PRIVMSG #c%d :%s%s", u, u, u,
+            (int)(rnd() % NChan), i % 50 ? "" : "bench: ", t);
+    }
+}
+
+static void
+genjoin(struct Lane *b, int n)
+{
+    int i, u;
+
+    for (i = 0; i < n; i++) {
+        u = rnd() % 100000;
+        switch (rnd() % 4) {
+        case 0:
+        case 1:
+            addf(b, ":j%d!~j@%d.joins.example.org JOIN #c%d", u, u, (int)(rnd() % NChan));
+            break;
+        case 2:
+            addf(b, ":j%d!~j@%d.joins.example.org PART #c%d :bye", u, u, (int)(rnd() % NChan));
+            break;
+        default:
+            addf(b, ":j%d!~j@%d.joins.example.org QUIT :Ping timeout: 240 seconds", u, u);
+        }
+    }
+}
+
+static void
+gennames(struct Lane *b, int n)
+{
+    char l[LineLen];
+    int i, c = 0;
+    size_t k;
+
+    for (i = 0; i < n; i++) {
+        if (i % 20 == 19) {
+            addf(b, ":irc.example.org 366 bench #c%d :End of /NAMES list.", c);
+            c = (c + 1) % NChan;
+            continue;
+        }
+        for (k = 0; k < 400;)
+            k += snprintf(l + k, sizeof l - k, "%s%s%d ", rnd() % 10 ? "" : "@",
+                "member", (int)(rnd() % 100000));
+        addf(b, ":irc.example.org 353 bench = #c%d :%s", c, l);
+    }
+}
+
+static void
+genutf8(struct Lane *b, int n)
+{
+    static const char *const w[] = {"héllo", "wörld", "日本語の", "テキスト",
+        "🙂", "😀👍", "e\xcc\x81t\xc3\xa9", "Ελληνικά", "русский", "中文字符",
+        "한국어", "ASCII", "mixed-ＦＵＬＬ"};
+    char t[480];
+    int i, u;
+
+    for (i = 0; i < n; i++) {
+        u = rnd() % NNick;
+        words(t, sizeof t, w, sizeof w / sizeof *w);
+        addf(b, ":nick%d!~u%d@host%d.example.org PRIVMSG #c%d :%s", u, u, u,
+            (int)(rnd() % NChan), t);
+    }
+}
+
+static void
+genmixed(struct Lane *b, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i += 100) {
+        genmsg(b, 60);
+        genjoin(b, 20);
+        gennames(b, 10);
+        genutf8(b, 10);
+    }
+}
+
+static const struct Gen gens[] = {
+    {"privmsg", genmsg},
+    {"join", genjoin},
+    {"names", gennames},
+    {"utf8", genutf8},
+    {"mixed", genmixed},
+};
+
+static int render;
+
+/* Feed buf through the same steps as srd() and ndrain(), timing each. */
+static void
+replay(const char *name, const char *buf, size_t len)
+{
+    static struct Msg msg;
+    long long t0, t1, t2, tp = 0, td = 0, tr = 0, all;
+    char *w, *l, *s, *e;
+    long nmsg = 0;
+    int i;
+
+    if (!(w = malloc(len + 1)))
+        panic("out of memory");
+    memcpy(w, buf, len);
+    e = w + len;
+    all = nsec();
+    for (l = w; l < e && (s = memchr(l, '\n', e - l)); l = s + 1) {
+        t0 = nsec();
+        if (s > l && s[-1] == '\r')
+            s[-1] = 0;
+        *s = 0;
+        utf8repair(l, s);
+        if (!mparse(l, s > l && !s[-1] ? s - 1 : s, &msg))
+            continue;
+        t1 = nsec();
+        nrecv(&msg, l, s, t0);
+        ndrain();
+        t2 = nsec();
+        tp += t1 - t0;
+        td += t2 - t1;
+        nt.out.tail = nt.out.head; /* Nothing is sent. */
+        for (i = 0; i < NLanes; i++)
+            srv->sq.lane[i].beg = srv->sq.lane[i].end = 0;
+        if (++nmsg % Frame == 0 && render) {
+            tflush();
+            tr += nsec() - t2;
+        }
+    }
+    all = nsec() - all;
+    free(w);
+    if (!nmsg)
+        return;
+    printf("%-10s %8ld msgs %10.0f msgs/s   parse %5.0f  dispatch %6.0f  render %5.0f ns/msg\n",
+        name, nmsg, nmsg / (all / 1e9), (double)tp / nmsg, (double)td / nmsg,
+        (double)tr / nmsg);
+}
+
+static void
+usage(void)
+{
+    fputs("usage: irc-bench [-r] [-n COUNT] [-g GEN]... [FILE]...\n"
+          "GEN is privmsg, join, names, utf8 or mixed; all run by default\n", stderr);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static char host[] = "irc.example.org";
+    const char *only[16];
+    struct Lane b = {0};
+    struct rusage ru;
+    char c[ChanLen];
+    int o, i, j, n = 100000, nonly = 0, out;
+    FILE *f;
+
+    while ((o = getopt(argc, argv, "rn:g:")) >= 0)
+        switch (o) {
+        case 'r':
+            render = 1;
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'g':
+            if (nonly == 16)
+                usage();
+            only[nonly++] = optarg;
+            break;
+        default:
+            usage();
+        }
+
+    /* The terminal goes to /dev/null, the report to the real stdout. */
+    out = dup(1);
+    setenv("TERM", "xterm", 0);
+    setenv("COLUMNS", "120", 1);
+    setenv("LINES", "40", 1);
+    if (!freopen("/dev/null", "w", stdout))
+        panic("cannot open /dev/null");
+    tinit();
+    if (!(stdout = fdopen(out, "w")))
+        panic("cannot open stdout");
+    strcpy(nick, "bench");
+    tnow = time(0);
+    rinit(&nt.in, NetRing);
+    rinit(&nt.out, OutRing);
+    nt.wake[1] = -1;
+    hlinit();
+    igbuild();
+    verbbuild();
+    sadd(host, "6667");
+    chadd(srvs[0].host, 0);
+    ust[0].buf = chl[0];
+    ust[0].lag = -1;
+    for (i = 0; i < NChan; i++) {
+        snprintf(c, sizeof c, "#c%d", i);
+        chadd(c, 1);
+    }
+    ch = 1; /* Lines to #c0 are drawn. */
+
+    for (i = optind; i < argc; i++) {
+        if (!(f = fopen(argv[i], "r")))
+            panic("cannot open traffic file");
+        while ((o = fread(lgrow(&b, 65536), 1, 65536, f)) >= 0) {
+            b.end -= 65536 - o;
+            if (o < 65536)
+                break;
+        }
+        fclose(f);
+        replay(argv[i], b.buf, b.end);
+        b.end = 0;
+    }
+    for (i = 0; i < (int)(sizeof gens / sizeof *gens); i++) {
+        if (optind < argc && !nonly)
+            break;
+        for (j = 0; j < nonly && strcmp(only[j], gens[i].name); j++)
+            ;
+        if (nonly && j == nonly)
+            continue;
+        gens[i].fn(&b, n);
+        replay(gens[i].name, b.buf, b.end);
+        b.end = 0;
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    printf("peak rss %ld kB, scrollback %zu kB in %d buffers\n",
+        ru.ru_maxrss, memtot >> 10, nch);
+    fflush(stdout);
+    free(b.buf);
+    treset();
+    return 0;
+}
@@ -19,9 +19,70 @@
 /* enable notifications (notify-send) */
 
 #define NOTIFY   1
+/* command run as NOTIFYCMD TITLE BODY, without a shell */
+#define NOTIFYCMD "notify-send"
+/* seconds between notifications for one channel; highlights in between
+ * are coalesced into "N highlights in #chan" */
+#define NOTIFYIVL 10
+
+/* words that highlight besides the nick, matched as whole words
+ * regardless of case */
+static const char *hlwords[] = {
+    /* "icyrc", */
+    NULL
+};
+/* extended regexes that highlight when found anywhere, regardless of case */
+static const char *hlregex[] = {
+    /* "^!(help|ops)", */
+    NULL
+};
+/* nick!user@host masks, with * and ?, whose messages are dropped */
+static const char *ignores[] = {
+    /* "*!*@spam.example.org", */
+    NULL
+};
 
 /* server */
 #define SRV      "irc.icyphox.sh"
 /* port */
 #define PORT     "6666"
 
+
+/* scrollback memory cap in bytes, per channel and for all channels;
+ * the oldest lines are dropped past it (-m overrides the latter) */
+#define CHANMEM  (8 << 20)
+#define TOTALMEM (64 << 20)
+
+/* maximum screen updates per second; messages arriving in between
+ * are drawn together on the next one */
+#define FPS      30
+
+/* log writer: batch records for LOGFLUSH ms per write; rotate past
+ * LOGMAXSZ bytes (0 for never) and, with LOGDAILY, at midnight UTC */
+#define LOGFLUSH   200
+#define LOGMAXSZ   0
+#define LOGDAILY   0
+/* when to fsync(2) logs: SyncNone, SyncBatch after every write, or
+ * SyncInterval every LOGSYNCIVL seconds */
+#define LOGSYNC    SyncNone
+#define LOGSYNCIVL 30
+
+/* lines of history reloaded into each buffer from the -L log, and
+ * sent with each buffer to a viewer attaching to -D */
+#define BACKLOG  200
+
+/* flood control: send up to FLOODBURST lines at once, then one every
+ * FLOODRATE ms; replies such as PONG are never held back */
+#define FLOODBURST 5
+#define FLOODRATE  2000
+
+/* send a PING every PINGIVL seconds to measure lag; reconnect once
+ * neither its PONG nor anything else came back for PINGTMO seconds */
+#define PINGIVL 30
+#define PINGTMO 60
+
+/* seconds between dumps of the counters to the -S file or socket */
+#define STATSIVL 10
+
+/* let the kernel decrypt tls when it can (linux, openssl 3) */
+#define KTLS 1
@@ -0,0 +1,63 @@
+/* Indexed log format, written by irc -L and read by irclog.
+ *
+ * DIR/log holds records back to back, each an IlogRec followed by the
+ * channel name and the message (neither NUL-terminated). DIR/idx holds
+ * one IlogIdx per record, in the same order, so the records of one
+ * channel or of a time range can be found without reading DIR/log.
+ * DIR/chan/HHHHHHHH holds the IlogIdx of the channels whose ilhash() is
+ * HHHHHHHH in hex, so that the last lines of one channel are found
+ * without going through those of the others. */
+
+#define ILOG_LOG  "log"
+#define ILOG_IDX  "idx"
+#define ILOG_CHAN "chan"
+
+struct IlogRec {
+    uint32_t len;  /* Of the whole record. */
+    uint16_t clen; /* Of the channel name. */
+    uint16_t mlen; /* Of the message. */
+    int64_t t;     /* Shown, the server's time when it gave one. */
+};
+
+struct IlogIdx {
+    uint32_t chan; /* ilhash() of the channel name. */
+    uint32_t len;  /* Of the record. */
+    int64_t t;     /* When it was logged, never less than the last. */
+    uint64_t off;  /* Of the record in DIR/log. */
+};
+
+/* FNV-1a of s, case-folded as in RFC 1459. */
+static inline uint32_t
+ilhash(const char *s, size_t n)
+{
+    uint32_t h = 2166136261u;
+    unsigned char c;
+
+    while (n--) {
+        c = *s++;
+        if (c >= 'A' && c <= '^')
+            c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+/* Whether a and b name the same channel. */
+static inline int
+ilsame(const char *a, size_t an, const char *b, size_t bn)
+{
+    unsigned char x, y;
+
+    if (an != bn)
+        return 0;
+    while (an--) {
+        x = *a++, y = *b++;
+        if (x >= 'A' && x <= '^')
+            x += 'a' - 'A';
+        if (y >= 'A' && y <= '^')
+            y += 'a' - 'A';
+        if (x != y)
+            return 0;
+    }
+    return 1;
+}
@@ -1,84 +1,536 @@
 #include <assert.h>
+#include <ctype.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
 
 #include <curses.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <locale.h>
+#include <regex.h>
 #include <wchar.h>
 #include <openssl/ssl.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #undef CTRL
 #define CTRL(x)  (x & 037)
 
 #include "config.h"
+#include "ilog.h"
 
 enum {
     ChanLen = 64,
     LineLen = 512,
-    MaxChans = 16,
+    LogName = 256 + ChanLen, /* Host, '/' and channel, naming a log. */
     BufSz = 2048,
-    LogSz = 4096,
+    InSz = 65536,   /* Room for a few TLS records per read. */
+    InMax = 1 << 20,
+    ChunkSz = 16384,
+    LogRing = 1 << 20, /* Bytes of records queued for the log writer. */
+    NetRing = 4 << 20, /* Bytes of messages queued for the UI, > InMax. */
+    OutRing = 1 << 16, /* Bytes of lines queued for the network. */
+    NoteRing = 1 << 16, /* Bytes of highlights queued for notification. */
+    LogBuf = 65536,   /* Bytes batched per log write(). */
     MaxRecons = 10, /* -1 for infinitely many */
     UtfSz = 4,
     RuneInvalid = 0xFFFD,
+    MaxPar = 15,
+    StampCache = 16,    /* Seconds of formatted timestamps kept. */
+    MaxAddrs = 16,      /* Addresses tried per connection. */
+    ConnDelay = 250,    /* Ms before racing the next address. */
+    ViewerMax = 8 << 20, /* Bytes queued to a viewer before it is dropped. */
+    ConnTimeout = 30,   /* Seconds to get a connection up. */
+    RetryDelay = 5,     /* Seconds between reconnections. */
+    StableUp = 60,      /* Seconds up before past failures are forgotten. */
+    LatRuns = 256,      /* Reads tracked per frame or log batch. */
+    MaxSrv = 32,        /* Servers connected to at once. */
+    PollBatch = 64,     /* Events taken per epoll_wait(). */
+};
+
+enum {
+    ConnDown,    /* Waiting to retry. */
+    ConnResolve, /* Resolver thread is running. */
+    ConnDial,    /* Connecting to the addresses in turn. */
+    ConnTls,     /* TLS handshake. */
+    ConnUp,
+};
+
+enum {
+    LaneCtl,  /* Replies and registration, jump the queue. */
+    LaneBulk, /* Everything else, paced by the token bucket. */
+    NLanes,
+};
+
+enum {
+    NetMsg,    /* A message from the server. */
+    NetNote,   /* Text for the server buffer. */
+    NetUp,     /* Link is up, register. */
+    NetStatus, /* Text for the status bar. */
+    NetFatal,  /* Give up with this error. */
+    NetLag,    /* Measured lag in ms, -1 if unknown. */
+};
+
+enum {
+    ModeLocal,
+    ModeDaemon, /* Headless, viewers attach over a socket. */
+    ModeAttach, /* Viewer of a daemon. */
+};
+
+/* Records between the daemon and its viewers. */
+enum {
+    VChan,   /* A buffer was opened. */
+    VPart,   /* It was closed. */
+    VRename, /* data is its new name. */
+    VLines,  /* data is lines for it, each ending with '\n'. */
+    VStatus, /* data is the lag, a space and the connection status. */
+    VInput,  /* From a viewer: data was typed in the buffer. */
+};
+
+enum {
+    VJoin = 1,   /* Buffer was joined. */
+    VFocus = 2,  /* Viewer should switch to it. */
+    VHigh = 4,   /* Line is a highlight. */
+    VOld = 8,    /* Lines are backlog. */
+    VServer = 16, /* Buffer is the server's own. */
+};
+
+enum {
+    StParse,    /* Per line, in the network thread. */
+    StDispatch, /* Per message, handlers included. */
+    StPush,     /* Per line added to a buffer. */
+    StRender,   /* Per frame. */
+    NStages,
+};
+
+enum {
+    SyncNone,
+    SyncBatch,
+    SyncInterval,
+};
+
+enum {
+    DirtyMain = 1,   /* Lines were added to the main window. */
+    DirtyRedraw = 2, /* The main window must be repainted. */
+    DirtyBar = 4,
 };
 
 typedef wchar_t Rune;
 
+typedef struct {
+    char *p;
+    size_t n;
+} Span;
+
+struct Msg {
+    Span tags;          /* Raw IRCv3 tags, without the leading '@'. */
+    Span nick, user, host;
+    Span cmd;
+    Span par[MaxPar];   /* Middle parameters, then the trailing one. */
+    int npar;
+    int trail;          /* Last parameter was a ':' trailing one. */
+};
+
 static struct {
     int x;
     int y;
     WINDOW *sw, *mw, *iw;
 } scr;
 
+struct Chunk {
+    struct Chunk *next;
+    unsigned long seq; /* Allocation order, oldest is evicted first. */
+    size_t len;
+    char buf[ChunkSz];
+};
+
+struct Line {
+    char *s;   /* Points into a chunk, ends with '\n'. */
+    short len; /* Length, without the '\n'. */
+    short w;   /* Window width brk was computed for, 0 if none. */
+    short nbrk;
+    unsigned short *brk; /* Offset of each wrapped row but the first. */
+};
+
 static struct Chan {
     char name[ChanLen];
-    char *buf, *eol;
-    int n;     /* Scroll offset. */
-    size_t sz; /* Size of buf. */
+    struct Chunk *head, *tail; /* Scrollback, oldest chunk first. */
+    size_t mem;   /* Bytes held in chunks. */
+    int n;        /* Scroll offset. */
+    struct Line *line, *lbuf; /* Line index; line points into lbuf. */
+    int nl, lsz;  /* Number of lines, and size of lbuf. */
     char high; /* Nick highlight. */
     char new;  /* New message. */
     char join; /* Channel was 'j'-oined. */
-} chl[MaxChans];
+    int idx;   /* Position in chl. */
+    int srv;   /* Server it belongs to, its namespace. */
+    unsigned long nmsg, nlast; /* Messages from the server, and at the last /stats. */
+    uint32_t hash;
+} **chl;       /* Channels, in the order they are shown. */
 
-static int ssl;
-static struct {
-    int fd;
-    SSL *ssl;
-    SSL_CTX *ctx;
-} srv;
+/* A second, formatted once for all the lines stamped with it. */
+struct Stamp {
+    time_t t;
+    char loc[64];   /* DATEFMT in local time, empty without it. */
+    size_t nloc;
+    char utc[24];   /* As in the text log. */
+};
+
+/* Durations in ns, four buckets per power of two. */
+struct Hist {
+    unsigned long b[64 * 4];
+};
+
+/* Lines on their way to the screen or the log, as runs of lines that
+ * came in the same read, to be added to a Hist once they are there. */
+struct Lat {
+    long long rx[LatRuns];
+    unsigned long n[LatRuns];
+    int nr;
+};
+
+static int ssl;      /* -t, TLS for every server. */
 static char nick[64];
+static time_t tnow;  /* Wall clock, read once per wakeup. */
+static time_t tmsg;  /* Server time of the message being handled, or 0. */
+static long long trx; /* When the message being handled was read, or 0. */
+static struct {
+    struct Hist scr, log; /* Receive to screen, and to log. */
+    struct Lat pend;      /* Lines not on the screen yet. */
+    int show;             /* Print them on exit. */
+} lat;
+static struct {
+    struct Hist h[NStages];
+    unsigned long rxb, rxl;   /* Read, by the network thread. */
+    unsigned long txb, txl;   /* Written, by the network thread. */
+    unsigned long outq;       /* Bytes waiting to be written. */
+    unsigned long sndl;       /* Lines queued by the UI. */
+    long long t0, tlast;      /* Start, and last /stats. */
+    const char *path;         /* Where to dump them, or 0. */
+    time_t dumpt;
+} stats;
+static const char *stname[NStages] = {"parse", "dispatch", "push", "render"};
+static struct Stamp uistamp[StampCache];
 static int quit, winchg;
+static int tdirty; /* Windows to update on the next frame. */
+static long long lastframe;
 static int nch, ch; /* Current number of channels, and current channel. */
-static char outb[BufSz], *outp = outb; /* Output buffer. */
-static FILE *logfp;
+static int chsz;    /* Size of chl. */
+static struct Chan **chtab; /* Open addressing table, by case-folded name. */
+static size_t chtsz;
+
+struct Lane {
+    char *buf;
+    size_t sz, beg, end; /* Queued bytes are buf[beg..end). */
+};
+
+/* A server connection, owned by the network thread. */
+static struct Srv {
+    int fd;
+    SSL *ssl;
+    const char *host, *port;
+    const char *pass;   /* To register with. */
+    int tls;            /* Connect with TLS. */
+    int st;             /* Conn* state of the connection. */
+    int tries;          /* Failed attempts since it was last up a while. */
+    int up;             /* It was up at least once. */
+    long long tup;      /* When it last came up. */
+    long long t;        /* Deadline of the current state. */
+    pthread_t thr;      /* Resolver. */
+    int wake[2];        /* Resolver is done. */
+    int gai;            /* Resolver's getaddrinfo() result. */
+    struct addrinfo *res;
+    struct addrinfo *addr[MaxAddrs]; /* Addresses, in the order to try them. */
+    int afd[MaxAddrs];  /* Connection attempt to each, -1 if none. */
+    int na, next;       /* Number of addresses, and next to try. */
+    long long tnext;    /* When to start the next attempt. */
+    int want;           /* What the TLS handshake waits for. */
+    SSL_SESSION *sess;  /* Last session or ticket, to resume. */
+    long long ths;      /* Start, then duration, of the handshake. */
+    int resumed;
+    int reg;            /* Server welcomed us, PINGs will be answered. */
+    long long ping;     /* When our unanswered PING went out, or 0. */
+    long long pingt;    /* When to send the next one. */
+    long long rxt;      /* When anything was last read. */
+    int dead;           /* Given up on. */
+    int on;             /* Was up when the fds were picked. */
+    struct {
+        struct Lane lane[NLanes]; /* Lines waiting to be let through. */
+        struct Lane wire;         /* Lines let through, being written. */
+        double tok;               /* Lines that may be sent right away. */
+        long long tokt;           /* When tok was last refilled. */
+    } sq;
+    struct {
+        char *buf;
+        size_t sz;   /* Size of buf. */
+        size_t len;  /* Bytes held in buf. */
+        int skip;    /* Discarding the tail of a line over InMax. */
+    } inb;
+} srvs[MaxSrv], *srv = srvs; /* srv is the one being handled. */
+static int nsrv;
+static SSL_CTX *sslctx;
+
+/* Lock-free ring between one producer and one consumer thread. Records
+ * start with their length and do not wrap; a 0 length pads to the end. */
+struct Ring {
+    char *q;
+    size_t sz;
+    unsigned long head; /* Bytes queued, owned by the producer. */
+    unsigned long tail; /* Bytes consumed, owned by the consumer. */
+};
+
+/* Descriptors waited on through epoll. Each round, what is waited for
+ * is declared again with pwant(); only changes reach the kernel, and
+ * descriptors left out are dropped. */
+struct Poll {
+    int ep;
+    struct Pfd {
+        uint32_t want, reg, got; /* Events wanted this round, registered, ready. */
+        unsigned long gen;       /* Round it was last wanted in. */
+    } *fd;
+    int nfd;                     /* Size of fd. */
+    int *cur, *last;             /* Descriptors wanted this round, and the last. */
+    int ncur, nlast, sz;
+    unsigned long gen;
+};
+
+struct NetRec {
+    uint32_t len;
+    uint8_t kind, srv;
+    uint8_t npar, trail;
+    long long rx;               /* When it was read. */
+    uint32_t sp[5 + MaxPar][2]; /* Offset and length of each Msg span. */
+    char data[];                /* Line, or NUL-terminated text. */
+};
+
+struct VRec {
+    uint32_t len;   /* Of the whole record. */
+    uint8_t kind, flags;
+    uint8_t srv;    /* Server the buffer belongs to. */
+    uint8_t clen;   /* Of the buffer name data starts with. */
+    char data[];
+};
+
+struct Viewer {
+    int fd;
+    struct Lane in, out;
+    size_t max;         /* Bytes queued to it before it is dropped. */
+};
+
+static struct {
+    int mode;
+    const char *path;   /* Socket. */
+    int lfd;            /* Listening on it, in the daemon. */
+    struct Viewer *v;
+    int nv;
+    struct Viewer *cur; /* Whose input is being handled. */
+    int fd;             /* Daemon, in a viewer. */
+    struct Lane in;
+} dm;
+static int pushhl; /* The line being pushed is a highlight. */
+static int pushold; /* It is backlog, reloaded from the log. */
+
+struct OutRec {
+    uint32_t len;
+    uint16_t n, srv;
+    char l[];   /* Line, with its CRLF. */
+};
+
+static struct {
+    struct Ring in;   /* NetRec, network thread to UI. */
+    struct Ring out;  /* OutRec, UI to network thread. */
+    struct Lane ovf;  /* NetRec that did not fit in, while the UI is behind. */
+    int pend;         /* Records were queued since the UI was woken. */
+    int uiwake[2];    /* Hurry the UI up. */
+    int wake[2];      /* Hurry the network thread up. */
+    int quit, dead;
+    struct Poll pl;   /* What the network thread waits on. */
+    pthread_t thr;
+} nt;
+static struct Poll uipl; /* What the UI waits on. */
+static char key[128];          /* To register with, unless a server has its own. */
+static const char *user;
+static struct {
+    struct Chan *buf;          /* Server buffer. */
+    char st[64];               /* Connection status, for the bar. */
+    long long lag;             /* Ms, as last measured, -1 if unknown. */
+} ust[MaxSrv];                 /* Servers, as the UI sees them. */
+static int us;                 /* Server the UI is handling. */
+
+struct LogRec {
+    uint32_t len;  /* Of the whole record, a multiple of 8. */
+    uint32_t clen; /* Length of the channel name. */
+    time_t t;      /* Shown, by the server's clock when it gives one. */
+    time_t lt;     /* When it was logged, by ours. */
+    long long rx;  /* When the message was read, or 0. */
+    char data[];   /* Channel name and message, NUL-terminated. */
+};
+
+struct LogFile {
+    char name[LogName]; /* Channel, in per-channel mode. */
+    int fd;
+    off_t sz;
+    long day;           /* UTC day the file was opened on. */
+    size_t len;         /* Bytes pending in buf. */
+    char *buf;
+};
+
+/* Index of the channels with one ilhash(), in the indexed log. */
+struct ChanIdx {
+    uint32_t chan;
+    int fd;
+    int n;              /* Entries pending in x. */
+    struct IlogIdx x[64];
+};
+
+static struct {
+    char *path;         /* Text log, or 0. */
+    int perchan;        /* path is a directory, one file per channel. */
+    char *ipath;        /* Indexed log directory, or 0. */
+    int lfd, xfd;       /* Its log and idx files. */
+    uint64_t loff;      /* Size of the log file. */
+    time_t xt;          /* Last time in the idx file, which never goes back. */
+    char *lbuf, *xbuf;  /* Pending writes to them. */
+    size_t llen, xlen;
+    struct ChanIdx *ci; /* Per-channel indexes. */
+    int nci;
+    struct Ring q;      /* Records, main thread to writer. */
+    unsigned long drops;
+    int quit;
+    int wake[2];        /* Pipe to hurry the writer up. */
+    pthread_t thr;
+    struct LogFile *f;  /* Writer state. */
+    int nf;
+    time_t synct;
+    struct Stamp stamp[StampCache];
+    struct Lat lat;     /* Records not written yet. */
+} lg;
+struct NoteRec {
+    uint32_t len;
+    uint32_t srv;    /* Of the channel. */
+    uint32_t ul, cl; /* Lengths of the nick and channel in data. */
+    char data[];     /* Nick, channel and message, NUL-terminated. */
+};
+
+struct Note {
+    int srv;
+    char chan[ChanLen];
+    long long t;     /* When the last notification went out. */
+    int n;           /* Highlights held back since. */
+    char last[LineLen + ChanLen]; /* Title and body of the last of them. */
+    size_t tl;       /* Length of the title in last. */
+};
+
+static struct {
+    struct Ring q;   /* Highlights, main thread to notifier. */
+    int wake[2];
+    int quit;
+    pthread_t thr;
+    struct Note *c;  /* Notifier state, per channel. */
+    int nc;
+    int kids;        /* Notifications still running. */
+} ntf;
+/* Aho-Corasick automaton over case-folded bytes. */
+struct Ac {
+    unsigned char cls[256]; /* Character class of each byte, 0 if in no pattern. */
+    int ncls;
+    int *go;    /* Transitions, ncls per state, failures folded in. */
+    int *out;   /* Pattern ending in each state, -1 if none. */
+    int *dict;  /* Nearest state on the failure chain with an output. */
+    int nst;
+    int *len;   /* Length of each pattern. */
+    int *alt;   /* Next pattern with the same text, -1 if none. */
+};
+
+static struct Ac hlac, igac; /* Highlight words, and ignore mask anchors. */
+static regex_t *hlre;
+static int nhlre;
+static int *igalways;        /* Ignore masks without an anchor. */
+static int nigalways;
+static size_t memtot, memmax = TOTALMEM; /* Scrollback bytes, and cap. */
+static unsigned long chunkseq;
 
 static unsigned char utfbyte[UtfSz + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static unsigned char utfmask[UtfSz + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static Rune utfmin[UtfSz + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static Rune utfmax[UtfSz + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
 
-static void scmd(char *, char *, char *, char *);
+/* Ranges of zero width and of double width runes, the latter after
+ * Unicode's East Asian Wide and Fullwidth classes. */
+static const Rune zerow[][2] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+    {0x07A6, 0x07B0}, {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+    {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963},
+    {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1160, 0x11FF},
+    {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x2028, 0x202E},
+    {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+static const Rune widew[][2] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+    {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F320},
+    {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+    {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E},
+    {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+    {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+    {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+    {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+static void pushf(int, const char *, ...);
+static void ilreload(int);
+static void scmd(struct Msg *);
 static void tdrawbar(void);
 static void tredraw(void);
 static void treset(void);
+static void vpush(struct Chan *, const char *, size_t);
+static void vchan(struct Chan *);
+static void vpart(struct Chan *);
+static void vrename(struct Chan *, const char *);
+static void vstatus(int);
 
-static void
+static void __attribute__((noreturn))
 panic(const char *m)
 {
     treset();
@@ -86,6 +538,104 @@ panic(const char *m)
     exit(1);
 }
 
+static long long
+nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Index of the buffer of the server the UI is handling. */
+static int
+sbuf(void)
+{
+    return ust[us].buf ? ust[us].buf->idx : 0;
+}
+
+/* Count k durations of v ns. Other threads may read h meanwhile. */
+static void
+hadd(struct Hist *h, long long v, unsigned long k)
+{
+    int e, i;
+
+    if (v < 8)
+        i = v < 0 ? 0 : v;
+    else {
+        e = 63 - __builtin_clzll(v);
+        i = e * 4 + (v >> (e - 2) & 3);
+    }
+    __atomic_fetch_add(&h->b[i], k, __ATOMIC_RELAXED);
+}
+
+/* Lower bound of the bucket holding the p-th fraction of h, or -1. */
+static long long
+hpct(const struct Hist *h, double p, unsigned long *tot)
+{
+    unsigned long n = 0, k, c[64 * 4];
+    int i;
+
+    for (i = 0; i < 64 * 4; i++)
+        n += c[i] = __atomic_load_n(&h->b[i], __ATOMIC_RELAXED);
+    if (tot)
+        *tot = n;
+    if (!n)
+        return -1;
+    for (k = 0, i = 0; i < 64 * 4; i++)
+        if ((k += c[i]) >= p * n && c[i])
+            break;
+    return i < 8 ? i : (long long)(4 | (i & 3)) << (i / 4 - 2);
+}
+
+static void
+latadd(struct Lat *l, long long rx)
+{
+    if (l->nr && l->rx[l->nr - 1] == rx)
+        l->n[l->nr - 1]++;
+    else if (l->nr == LatRuns) /* Counted as if it came in with the last. */
+        l->n[l->nr - 1]++;
+    else {
+        l->rx[l->nr] = rx;
+        l->n[l->nr++] = 1;
+    }
+}
+
+/* The lines in l got where they were going. */
+static void
+latdone(struct Lat *l, struct Hist *h)
+{
+    long long now;
+    int i;
+
+    if (!l->nr)
+        return;
+    now = nsec();
+    for (i = 0; i < l->nr; i++)
+        hadd(h, now - l->rx[i], l->n[i]);
+    l->nr = 0;
+}
+
+static void
+latreport(FILE *f)
+{
+    static const double p[] = {.5, .9, .99, .999, 1};
+    const struct Hist *h[] = {&lat.scr, &lat.log};
+    const char *name[] = {"screen", "log"};
+    unsigned long n;
+    int i, j;
+
+    fputs("receive to   lines       p50       p90       p99     p99.9       max (us)\n", f);
+    for (i = 0; i < 2; i++) {
+        if (hpct(h[i], 0, &n) < 0)
+            continue;
+        fprintf(f, "%-8s %9lu", name[i], n);
+        for (j = 0; j < 5; j++)
+            fprintf(f, " %9.1f", hpct(h[i], p[j], 0) / 1e3);
+        fputc('\n', f);
+    }
+}
+
 static size_t
 utf8validate(Rune *u, size_t i)
 {
@@ -151,446 +701,3321 @@ utf8encode(Rune u, char *c)
     return len;
 }
 
+/* Length of the 7-bit prefix of p. */
+static size_t
+asciilen(const char *p, size_t n)
+{
+    size_t i = 0;
+    uint64_t w;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        unsigned m = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(p + i)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, p + i, 8);
+        if (w & 0x8080808080808080ULL)
+            break;
+    }
+    for (; i < n && !(p[i] & 0x80); i++)
+        ;
+    return i;
+}
+
+/* Replace every byte of p..e that is not part of valid UTF-8 by '?'. */
 static void
-sndf(const char *fmt, ...)
+utf8repair(char *p, char *e)
 {
-    va_list vl;
-    size_t n, l = BufSz - (outp - outb);
+    size_t n, i;
+    Rune u;
 
-    if (l < 2)
-        return;
-    va_start(vl, fmt);
-    n = vsnprintf(outp, l - 2, fmt, vl);
-    va_end(vl);
-    outp += n > l - 2 ? l - 2 : n;
-    *outp++ = '\r';
-    *outp++ = '\n';
+    while ((p += asciilen(p, e - p)) < e) {
+        u = utf8decodebyte(*p, &n);
+        if (n < 2 || n > UtfSz || (size_t)(e - p) < n) {
+            *p++ = '?';
+            continue;
+        }
+        for (i = 1; i < n && (p[i] & 0xC0) == 0x80; i++)
+            u = (u << 6) | (p[i] & 0x3F);
+        if (i < n || u < utfmin[n] || u > utfmax[n] || (0xD800 <= u && u <= 0xDFFF)) {
+            *p++ = '?';
+            continue;
+        }
+        p += n;
+    }
 }
 
 static int
-srd(void)
+inranges(Rune u, const Rune (*r)[2], size_t n)
 {
-    static char l[BufSz], *p = l;
-    char *s, *usr, *cmd, *par, *data;
-    int rd;
-    if (p - l >= BufSz)
-        p = l; /* Input buffer overflow, there should something better to do. */
-    if (ssl)
-        rd = SSL_read(srv.ssl, p, BufSz - (p - l));
-    else
-        rd = read(srv.fd, p, BufSz - (p - l));
-    if (rd <= 0)
+    size_t lo = 0, hi = n, m;
+
+    if (u < r[0][0] || u > r[n - 1][1])
         return 0;
-    p += rd;
-    for (;;) { /* Cycle on all received lines. */
-        if (!(s = memchr(l, '\n', p - l)))
+    while (lo < hi) {
+        m = (lo + hi) / 2;
+        if (u < r[m][0])
+            hi = m;
+        else if (u > r[m][1])
+            lo = m + 1;
+        else
             return 1;
-        if (s > l && s[-1] == '\r')
-            s[-1] = 0;
-        *s++ = 0;
-        if (*l == ':') {
-            if (!(cmd = strchr(l, ' ')))
-                goto lskip;
-            *cmd++ = 0;
-            usr = l + 1;
-        } else {
-            usr = 0;
-            cmd = l;
-        }
-        if (!(par = strchr(cmd, ' ')))
-            goto lskip;
-        *par++ = 0;
-        if ((data = strchr(par, ':')))
-            *data++ = 0;
-        scmd(usr, cmd, par, data);
-    lskip:
-        memmove(l, s, p - s);
-        p -= s - l;
-    }
-}
-
-static void
-sinit(const char *key, const char *nick, const char *user)
-{
-    if (key)
-        sndf("PASS %s", key);
-    sndf("NICK %s", nick);
-    sndf("USER %s 8 * :%s", user, user);
-    sndf("MODE %s +i", nick);
+    }
+    return 0;
 }
 
-static char *
-dial(const char *host, const char *service)
+/* Decode the rune at p, returning its length and its width in *w. */
+static size_t
+runewidth(const char *p, const char *e, int *w)
 {
-    struct addrinfo hints, *res = NULL, *rp;
-    int fd = -1, e;
+    size_t n;
+    Rune u;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;     /* allow IPv4 or IPv6 */
-    hints.ai_flags = AI_NUMERICSERV; /* avoid name lookup for port */
-    hints.ai_socktype = SOCK_STREAM;
-    if ((e = getaddrinfo(host, service, &hints, &res)))
-        return "Getaddrinfo failed.";
-    for (rp = res; rp; rp = rp->ai_next) {
-        if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1)
-            continue;
-        if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
-            close(fd);
-            continue;
-        }
-        break;
+    if (!(*p & 0x80)) {
+        *w = 1;
+        return 1;
     }
-    if (fd == -1)
-        return "Cannot connect to host.";
-    srv.fd = fd;
-    if (ssl) {
-        SSL_load_error_strings();
-        SSL_library_init();
-        srv.ctx = SSL_CTX_new(SSLv23_client_method());
-        if (!srv.ctx)
-            return "Could not initialize ssl context.";
-        srv.ssl = SSL_new(srv.ctx);
-        if (SSL_set_fd(srv.ssl, srv.fd) == 0
-        || SSL_connect(srv.ssl) != 1)
-            return "Could not connect with ssl.";
-    }
-    freeaddrinfo(res);
-    return 0;
+    if (!(n = utf8decode((char *)p, &u, e - p)))
+        n = 1;
+    if (inranges(u, zerow, sizeof zerow / sizeof *zerow))
+        *w = 0;
+    else
+        *w = 1 + inranges(u, widew, sizeof widew / sizeof *widew);
+    return n;
+}
+
+static unsigned char
+fold(unsigned char c)
+{
+    return c >= 'A' && c <= '^' ? c + 'a' - 'A' : c; /* As RFC 1459. */
 }
 
 static void
-hangup(void)
+acfree(struct Ac *a)
+{
+    free(a->go);
+    free(a->out);
+    free(a->dict);
+    free(a->len);
+    free(a->alt);
+    memset(a, 0, sizeof *a);
+}
+
+/* Compile the np patterns p[i], of length n[i] > 0, into a. */
+static void
+acbuild(struct Ac *a, const char **p, const size_t *n, int np)
 {
-    if (srv.ssl) {
-        SSL_shutdown(srv.ssl);
-        SSL_free(srv.ssl);
-        srv.ssl = 0;
+    int i, c, s, t, nst = 1, *fail, *q, qh, qt;
+    size_t j, tot = 1;
+
+    acfree(a);
+    a->ncls = 1;
+    for (i = 0; i < np; i++)
+        for (j = 0; j < n[i]; j++)
+            if (!a->cls[c = fold(p[i][j])])
+                a->cls[c] = a->ncls++;
+    for (c = 0; c < 256; c++)
+        a->cls[c] = a->cls[fold(c)];
+    for (i = 0; i < np; i++)
+        tot += n[i];
+    a->go = malloc(tot * a->ncls * sizeof *a->go);
+    a->out = malloc(tot * sizeof *a->out);
+    a->dict = calloc(tot, sizeof *a->dict);
+    a->len = malloc((np + 1) * sizeof *a->len);
+    a->alt = malloc((np + 1) * sizeof *a->alt);
+    fail = malloc(tot * sizeof *fail);
+    q = malloc(tot * sizeof *q);
+    if (!a->go || !a->out || !a->dict || !a->len || !a->alt || !fail || !q)
+        panic("out of memory");
+    memset(a->go, -1, tot * a->ncls * sizeof *a->go);
+    memset(a->out, -1, tot * sizeof *a->out);
+    for (i = 0; i < np; i++) { /* Trie. */
+        for (s = 0, j = 0; j < n[i]; j++) {
+            int *g = &a->go[s * a->ncls + a->cls[(unsigned char)p[i][j]]];
+
+            if (*g < 0)
+                *g = nst++;
+            s = *g;
+        }
+        a->len[i] = n[i];
+        a->alt[i] = a->out[s];
+        a->out[s] = i;
+    }
+    qh = qt = 0;
+    for (c = 0; c < a->ncls; c++) {
+        if ((t = a->go[c]) < 0)
+            a->go[c] = 0;
+        else
+            fail[t] = 0, q[qt++] = t;
     }
-    if (srv.fd) {
-        close(srv.fd);
-        srv.fd = 0;
+    while (qh < qt) { /* Fold the failure links into the transitions. */
+        s = q[qh++];
+        for (c = 0; c < a->ncls; c++) {
+            t = a->go[s * a->ncls + c];
+            if (t < 0) {
+                a->go[s * a->ncls + c] = a->go[fail[s] * a->ncls + c];
+                continue;
+            }
+            fail[t] = a->go[fail[s] * a->ncls + c];
+            a->dict[t] = a->out[fail[t]] >= 0 ? fail[t] : a->dict[fail[t]];
+            q[qt++] = t;
+        }
     }
-    if (srv.ctx) {
-        SSL_CTX_free(srv.ctx);
-        srv.ctx = 0;
+    a->nst = nst;
+    free(fail);
+    free(q);
+}
+
+/* Call fn for each pattern found in s, with where it starts and ends,
+ * until it returns non-zero. Returns what fn last returned. */
+static int
+acscan(const struct Ac *a, const char *s, size_t n,
+    int (*fn)(int, const char *, size_t, size_t, size_t, void *), void *arg)
+{
+    size_t i;
+    int st = 0, t, p;
+
+    if (!a->nst)
+        return 0;
+    for (i = 0; i < n; i++) {
+        st = a->go[st * a->ncls + a->cls[(unsigned char)s[i]]];
+        for (t = a->out[st] >= 0 ? st : a->dict[st]; t; t = a->dict[t])
+            for (p = a->out[t]; p >= 0; p = a->alt[p])
+                if (fn(p, s, n, i + 1 - a->len[p], i + 1, arg))
+                    return 1;
     }
+    return 0;
 }
 
-static inline int
-chfind(const char *name)
+static int
+wordc(unsigned char c)
 {
-    int i;
+    return isalnum(c) || c >= 0x80 || (c && strchr("_-[]\\`^{}|", c));
+}
 
-    assert(name);
-    for (i = nch - 1; i > 0; i--)
-        if (!strcmp(chl[i].name, name))
-            break;
-    return i;
+static int
+hlword(int p, const char *s, size_t n, size_t b, size_t e, void *arg)
+{
+    (void)p, (void)arg;
+    return (!b || !wordc(s[b - 1])) && (e == n || !wordc(s[e]));
 }
 
+/* Whether msg highlights us: our nick or one of hlwords as a whole
+ * word, or one of hlregex anywhere. */
 static int
-chadd(const char *name, int joined)
+hlmatch(const char *msg)
 {
-    int n;
+    int i;
 
-    if (nch >= MaxChans || strlen(name) >= ChanLen)
-        return -1;
-    if ((n = chfind(name)) > 0)
-        return n;
-    strcpy(chl[nch].name, name);
-    chl[nch].sz = LogSz;
-    chl[nch].buf = malloc(LogSz);
-    if (!chl[nch].buf)
+    if (acscan(&hlac, msg, strlen(msg), hlword, 0))
+        return 1;
+    for (i = 0; i < nhlre; i++)
+        if (!regexec(&hlre[i], msg, 0, 0, 0))
+            return 1;
+    return 0;
+}
+
+/* Recompile the highlight words, as they include our nick. */
+static void
+hlbuild(void)
+{
+    const char *p[sizeof hlwords / sizeof *hlwords + 1];
+    size_t n[sizeof hlwords / sizeof *hlwords + 1];
+    int i, np = 0;
+
+    p[np] = nick;
+    n[np++] = strlen(nick);
+    for (i = 0; hlwords[i]; i++)
+        if ((n[np] = strlen(p[np] = hlwords[i])))
+            np++;
+    acbuild(&hlac, p, n, np);
+}
+
+static void
+hlinit(void)
+{
+    int i;
+
+    for (nhlre = 0; hlregex[nhlre]; nhlre++)
+        ;
+    if (nhlre && !(hlre = malloc(nhlre * sizeof *hlre)))
         panic("out of memory");
-    chl[nch].eol = chl[nch].buf;
-    chl[nch].n = 0;
-    chl[nch].join = joined;
-    if (joined)
-        ch = nch;
-    nch++;
-    tdrawbar();
-    return nch;
+    for (i = 0; i < nhlre; i++)
+        if (regcomp(&hlre[i], hlregex[i], REG_EXTENDED | REG_ICASE | REG_NOSUB))
+            panic("bad regex in hlregex");
+    hlbuild();
 }
 
+/* Match s against the glob g, case-folded. */
 static int
-chdel(char *name)
+glob(const char *g, const char *s)
 {
-    int n;
+    const char *gs = 0, *ss = 0;
 
-    if (!(n = chfind(name)))
-        return 0;
-    nch--;
-    free(chl[n].buf);
-    memmove(&chl[n], &chl[n + 1], (nch - n) * sizeof(struct Chan));
-    ch = nch - 1;
-    tdrawbar();
-    return 1;
+    while (*s) {
+        if (*g == '*')
+            gs = ++g, ss = s;
+        else if (*g == '?' || (*g && fold(*g) == fold(*s)))
+            g++, s++;
+        else if (gs)
+            g = gs, s = ++ss;
+        else
+            return 0;
+    }
+    while (*g == '*')
+        g++;
+    return !*g;
+}
+
+static int
+igmask(int p, const char *s, size_t n, size_t b, size_t e, void *arg)
+{
+    (void)n, (void)b, (void)e, (void)arg;
+    return glob(ignores[p], s);
 }
 
-static char *
-pushl(char *p, char *e)
-{
-    int x, cl;
-    char *w;
-    Rune u[2];
-    cchar_t cc;
-
-    u[1] = 0;
-    if ((w = memchr(p, '\n', e - p)))
-        e = w + 1;
-    w = p;
-    x = 0;
-    for (;;) {
-        if (x >= scr.x) {
-            waddch(scr.mw, '\n');
-            for (x = 0; x < INDENT; x++)
-                waddch(scr.mw, ' ');
-            if (*w == ' ')
-                w++;
-            x += p - w;
-        }
-        if (p >= e || *p == ' ' || p - w + INDENT >= scr.x - 1) {
-            while (w < p) {
-                w += utf8decode(w, u, UtfSz);
-                if (wcwidth(*u) > 0 || *u == '\n') {
-                    setcchar(&cc, u, 0, 0, 0);
-                    wadd_wch(scr.mw, &cc);
-                }
-            }
-            if (p >= e)
-                return e;
+/* Index the ignore masks by their longest run of literal characters,
+ * so that only masks whose run occurs in a prefix are tried on it. */
+static void
+igbuild(void)
+{
+    size_t ni = sizeof ignores / sizeof *ignores, *n, k;
+    const char **p, *g;
+    int i;
+
+    if (!(p = malloc(ni * sizeof *p)) || !(n = malloc(ni * sizeof *n))
+    || !(igalways = malloc(ni * sizeof *igalways)))
+        panic("out of memory");
+    for (i = 0; ignores[i]; i++) {
+        p[i] = ignores[i], n[i] = 0;
+        for (g = ignores[i]; *g; g += k ? k : 1) {
+            k = strcspn(g, "*?");
+            if (k > n[i])
+                p[i] = g, n[i] = k;
+        }
+        if (!n[i]) {
+            igalways[nigalways++] = i;
+            p[i] = "\n", n[i] = 1; /* Never occurs in a prefix. */
+        }
+    }
+    acbuild(&igac, p, n, i);
+    free(p);
+    free(n);
+}
+
+/* Whether messages from this prefix are ignored. */
+static int
+igmatch(const struct Msg *m)
+{
+    char s[LineLen];
+    int i;
+
+    if (!m->user.n && !m->host.n)
+        return 0; /* A server. */
+    snprintf(s, sizeof s, "%s!%s@%s", m->nick.p, m->user.p, m->host.p);
+    for (i = 0; i < nigalways; i++)
+        if (glob(ignores[igalways[i]], s))
+            return 1;
+    return acscan(&igac, s, strlen(s), igmask, 0);
+}
+
+/* Append n bytes to l, to be filled in. */
+static char *
+lgrow(struct Lane *l, size_t n)
+{
+    if (l->end + n > l->sz) {
+        if (l->beg) { /* Compact before growing. */
+            memmove(l->buf, l->buf + l->beg, l->end - l->beg);
+            l->end -= l->beg;
+            l->beg = 0;
+        }
+        while (l->end + n > l->sz)
+            l->sz = l->sz ? l->sz * 2 : BufSz;
+        if (!(l->buf = realloc(l->buf, l->sz)))
+            panic("out of memory");
+    }
+    l->end += n;
+    return l->buf + l->end - n;
+}
+
+static void
+lpush(struct Lane *l, const char *p, size_t n)
+{
+    memcpy(lgrow(l, n), p, n);
+}
+
+static void
+lpop(struct Lane *l, size_t n)
+{
+    l->beg += n;
+    if (l->beg == l->end)
+        l->beg = l->end = 0;
+}
+
+static void
+rinit(struct Ring *r, size_t sz)
+{
+    if (!(r->q = malloc(sz)))
+        panic("out of memory");
+    r->sz = sz;
+}
+
+/* Room for a record of need bytes, a multiple of 8, or 0 if full. */
+static void *
+rget(struct Ring *r, size_t need)
+{
+    unsigned long h = r->head, used;
+    size_t off = h % r->sz;
+
+    used = h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (used + need + (off + need > r->sz ? r->sz - off : 0) > r->sz)
+        return 0;
+    if (off + need > r->sz) {
+        *(uint32_t *)(r->q + off) = 0;
+        __atomic_store_n(&r->head, h + r->sz - off, __ATOMIC_RELEASE);
+        off = 0;
+    }
+    return r->q + off;
+}
+
+/* Publish the record rget() returned. */
+static void
+rput(struct Ring *r, size_t need)
+{
+    __atomic_store_n(&r->head, r->head + need, __ATOMIC_RELEASE);
+}
+
+/* The oldest record, or 0 if there is none. */
+static void *
+rnext(struct Ring *r)
+{
+    unsigned long t = r->tail;
+    uint32_t *p;
+
+    for (;;) {
+        if (t == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+            return 0;
+        p = (uint32_t *)(r->q + t % r->sz);
+        if (*p)
+            return p;
+        t += r->sz - t % r->sz;
+        __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+rdone(struct Ring *r, void *p)
+{
+    __atomic_store_n(&r->tail, r->tail + *(uint32_t *)p, __ATOMIC_RELEASE);
+}
+
+static void
+pinit(struct Poll *p)
+{
+    memset(p, 0, sizeof *p);
+    p->gen = 1;
+    if ((p->ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        panic("cannot create epoll");
+}
+
+/* Wait for events ev on fd in the coming pwait(). */
+static void
+pwant(struct Poll *p, int fd, uint32_t ev)
+{
+    struct Pfd *f;
+    int n;
+
+    if (fd >= p->nfd) {
+        n = fd < p->nfd * 2 ? p->nfd * 2 : fd + 64;
+        if (!(f = realloc(p->fd, n * sizeof *f)))
+            panic("out of memory");
+        memset(f + p->nfd, 0, (n - p->nfd) * sizeof *f);
+        p->fd = f;
+        p->nfd = n;
+    }
+    f = &p->fd[fd];
+    if (f->gen != p->gen) { /* First time this round. */
+        if (p->ncur == p->sz) {
+            p->sz = p->sz ? p->sz * 2 : 64;
+            if (!(p->cur = realloc(p->cur, p->sz * sizeof *p->cur))
+            || !(p->last = realloc(p->last, p->sz * sizeof *p->last)))
+                panic("out of memory");
+        }
+        p->cur[p->ncur++] = fd;
+        f->gen = p->gen;
+        f->want = 0;
+    }
+    f->want |= ev;
+}
+
+/* fd is about to be closed, which takes it out of the epoll set: its
+ * number may come back for another file. */
+static void
+pdrop(struct Poll *p, int fd)
+{
+    if (fd >= 0 && fd < p->nfd)
+        p->fd[fd].reg = p->fd[fd].got = 0;
+}
+
+/* Bring the epoll set in line with this round, and wait up to tmo ns. */
+static int
+pwait(struct Poll *p, long long tmo)
+{
+    struct epoll_event ev[PollBatch], e;
+    struct Pfd *f;
+    int i, n, *t;
+
+    for (i = 0; i < p->nlast; i++) {
+        f = &p->fd[p->last[i]];
+        if (f->gen != p->gen && f->reg) {
+            epoll_ctl(p->ep, EPOLL_CTL_DEL, p->last[i], 0);
+            f->reg = f->got = 0;
+        }
+    }
+    for (i = 0; i < p->ncur; i++) {
+        f = &p->fd[p->cur[i]];
+        f->got = 0;
+        if (f->want == f->reg)
+            continue;
+        e.events = f->want;
+        e.data.fd = p->cur[i];
+        if (epoll_ctl(p->ep, f->reg ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, p->cur[i], &e) < 0)
+            return -1;
+        f->reg = f->want;
+    }
+    t = p->last, p->last = p->cur, p->cur = t;
+    p->nlast = p->ncur;
+    p->ncur = 0;
+    p->gen++;
+    if ((n = epoll_wait(p->ep, ev, PollBatch, tmo <= 0 ? 0 : (tmo + 999999) / 1000000)) < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+        p->fd[ev[i].data.fd].got = ev[i].events;
+    return n;
+}
+
+/* Whether fd got ev, or an error a read or write will report. */
+static int
+pready(const struct Poll *p, int fd, uint32_t ev)
+{
+    return fd >= 0 && fd < p->nfd && p->fd[fd].got & (ev | EPOLLERR | EPOLLHUP);
+}
+
+static void
+pfree(struct Poll *p)
+{
+    close(p->ep);
+    free(p->fd);
+    free(p->cur);
+    free(p->last);
+}
+
+/* Queue a line for the server, from the UI thread. */
+static void
+sndf(const char *fmt, ...)
+{
+    struct OutRec *r;
+    va_list vl;
+    int n;
+
+    if (!(r = rget(&nt.out, sizeof *r + LineLen))) {
+        pushf(sbuf(), "-!- Send queue full, line dropped");
+        return;
+    }
+    va_start(vl, fmt);
+    n = vsnprintf(r->l, LineLen - 2, fmt, vl);
+    va_end(vl);
+    if (n > LineLen - 3)
+        n = LineLen - 3;
+    r->l[n++] = '\r';
+    r->l[n++] = '\n';
+    r->n = n;
+    r->srv = us;
+    r->len = (sizeof *r + n + 7) & ~7;
+    rput(&nt.out, r->len);
+    stats.sndl++;
+    write(nt.wake[1], "", 1);
+}
+
+/* Put a line in its lane, from the network thread. */
+static void
+sput(const char *l, size_t n)
+{
+    static const char *ctl[] = {"PONG ", "PING ", "CAP ", "PASS ", "NICK ",
+        "USER ", "AUTHENTICATE ", "QUIT"};
+    size_t i;
+    int lane = LaneBulk;
+
+    for (i = 0; i < sizeof ctl / sizeof *ctl; i++)
+        if (!strncmp(l, ctl[i], strlen(ctl[i])))
+            lane = LaneCtl;
+    lpush(&srv->sq.lane[lane], l, n);
+}
+
+/* Take the lines the UI queued, each to its server. */
+static void
+sintake(void)
+{
+    struct OutRec *r;
+
+    while ((r = rnext(&nt.out))) {
+        srv = &srvs[r->srv];
+        sput(r->l, r->n);
+        rdone(&nt.out, r);
+    }
+}
+
+/* Room for a record to the UI, in the ring unless it is behind. */
+static struct NetRec *
+nget(size_t need)
+{
+    struct NetRec *r;
+
+    if (nt.ovf.beg == nt.ovf.end && (r = rget(&nt.in, need)))
+        return r;
+    return (struct NetRec *)lgrow(&nt.ovf, need);
+}
+
+static void
+nput(struct NetRec *r)
+{
+    if ((char *)r >= nt.in.q && (char *)r < nt.in.q + nt.in.sz)
+        rput(&nt.in, r->len);
+    nt.pend = 1;
+}
+
+/* Move what was held back into the ring, as the UI makes room. */
+static void
+novf(void)
+{
+    struct NetRec *r, *q;
+
+    while (nt.ovf.beg < nt.ovf.end) {
+        q = (struct NetRec *)(nt.ovf.buf + nt.ovf.beg);
+        if (!(r = rget(&nt.in, q->len)))
+            break;
+        memcpy(r, q, q->len);
+        rput(&nt.in, r->len);
+        lpop(&nt.ovf, q->len);
+        nt.pend = 1;
+    }
+}
+
+/* Send text of some kind to the UI. */
+static void
+ntext(int kind, const char *fmt, ...)
+{
+    struct NetRec *r;
+    char b[LineLen];
+    va_list vl;
+    int n;
+
+    va_start(vl, fmt);
+    n = vsnprintf(b, sizeof b, fmt, vl);
+    va_end(vl);
+    if (n >= (int)sizeof b)
+        n = sizeof b - 1;
+    r = nget((sizeof *r + n + 1 + 7) & ~7);
+    r->len = (sizeof *r + n + 1 + 7) & ~7;
+    r->kind = kind;
+    r->srv = srv - srvs;
+    memcpy(r->data, b, n + 1);
+    nput(r);
+}
+
+static Span *
+mspan(struct Msg *m, int i)
+{
+    Span *fix[] = {&m->tags, &m->nick, &m->user, &m->host, &m->cmd};
+
+    return i < 5 ? fix[i] : &m->par[i - 5];
+}
+
+/* Handle a message from the server: answer PINGs right here, so the
+ * link stays up whatever the UI does, and hand the rest over. */
+static void
+nrecv(struct Msg *m, char *l, char *e, long long rx)
+{
+    struct NetRec *r;
+    size_t n = e - l + 1, need = (sizeof *r + n + 7) & ~7;
+    char b[LineLen], *p;
+    long long t;
+    Span *sp;
+    int i;
+
+    if (!strcmp(m->cmd.p, "001") && !srv->reg) {
+        srv->reg = 1;
+        srv->pingt = rx; /* Measure the lag right away. */
+    }
+    if (!strcmp(m->cmd.p, "PONG") && m->npar
+    && !strncmp(p = m->par[m->npar - 1].p, "icyrc-", 6)) {
+        t = strtoll(p + 6, 0, 10);
+        if (t == srv->ping)
+            srv->ping = 0;
+        ntext(NetLag, "%lld", (rx - t) / 1000000);
+        return;
+    }
+    if (!strcmp(m->cmd.p, "PING")) {
+        i = snprintf(b, sizeof b - 2, "PONG :%s", m->npar ? m->par[m->npar - 1].p : "(null)");
+        if (i > (int)sizeof b - 3)
+            i = sizeof b - 3;
+        b[i++] = '\r';
+        b[i++] = '\n';
+        sput(b, i);
+        return;
+    }
+    if (igmatch(m))
+        return;
+    r = nget(need);
+    r->len = need;
+    r->kind = NetMsg;
+    r->srv = srv - srvs;
+    r->npar = m->npar;
+    r->trail = m->trail;
+    r->rx = rx;
+    for (i = 0; i < 5 + m->npar; i++) {
+        sp = mspan(m, i);
+        r->sp[i][0] = sp->p - l;
+        r->sp[i][1] = sp->n;
+    }
+    memcpy(r->data, l, n);
+    nput(r);
+}
+
+/* Let queued lines through to the wire as the token bucket allows.
+ * Returns the nanoseconds until the next bulk line may go, or -1. */
+static long long
+sqpump(void)
+{
+    struct Lane *l;
+    char *p, *e;
+    long long now = nsec();
+
+    srv->sq.tok += (now - srv->sq.tokt) / (FLOODRATE * 1e6);
+    if (srv->sq.tok > FLOODBURST)
+        srv->sq.tok = FLOODBURST;
+    srv->sq.tokt = now;
+    for (l = srv->sq.lane; l < &srv->sq.lane[NLanes]; l++) {
+        while (l->beg < l->end && (l == &srv->sq.lane[LaneCtl] || srv->sq.tok >= 1)) {
+            p = l->buf + l->beg;
+            e = memchr(p, '\n', l->end - l->beg) + 1;
+            lpush(&srv->sq.wire, p, e - p);
+            lpop(l, e - p);
+            srv->sq.tok--; /* Control lines may run into debt. */
+        }
+    }
+    if (srv->sq.lane[LaneBulk].beg == srv->sq.lane[LaneBulk].end)
+        return -1;
+    return (1 - srv->sq.tok) * FLOODRATE * 1e6;
+}
+
+/* Split the NUL-terminated line l..e into m. Spans point into l and are
+ * NUL-terminated in place, so handlers can use them as C strings. */
+static int
+mparse(char *l, char *e, struct Msg *m)
+{
+    char *p = l, *q;
+
+    m->tags.n = m->nick.n = m->user.n = m->host.n = 0;
+    m->tags.p = m->nick.p = m->user.p = m->host.p = e;
+    m->npar = m->trail = 0;
+    if (*p == '@') {
+        if (!(q = memchr(p, ' ', e - p)))
+            return 0;
+        m->tags.p = p + 1;
+        m->tags.n = q - p - 1;
+        *q = 0;
+        for (p = q + 1; *p == ' '; p++)
+            ;
+    }
+    if (*p == ':') {
+        m->nick.p = ++p;
+        for (; p < e && *p != ' '; p++) {
+            if (*p == '!' && !m->user.n && m->host.p == e) {
+                m->nick.n = p - m->nick.p;
+                m->user.p = p + 1;
+                *p = 0;
+            } else if (*p == '@' && m->host.p == e) {
+                if (m->user.p == e)
+                    m->nick.n = p - m->nick.p;
+                else
+                    m->user.n = p - m->user.p;
+                m->host.p = p + 1;
+                *p = 0;
+            }
+        }
+        if (m->host.p != e)
+            m->host.n = p - m->host.p;
+        else if (m->user.p != e)
+            m->user.n = p - m->user.p;
+        else
+            m->nick.n = p - m->nick.p;
+        if (p == e)
+            return 0;
+        for (*p++ = 0; *p == ' '; p++)
+            ;
+    }
+    m->cmd.p = p;
+    for (; p < e && *p != ' '; p++)
+        ;
+    if (!(m->cmd.n = p - m->cmd.p))
+        return 0;
+    while (p < e) {
+        for (*p++ = 0; *p == ' '; p++)
+            ;
+        if (p == e)
+            break;
+        if (*p == ':' || m->npar == MaxPar - 1) {
+            m->trail = *p == ':';
+            m->par[m->npar].p = p + m->trail;
+            m->par[m->npar++].n = e - p - m->trail;
+            break;
+        }
+        m->par[m->npar].p = p;
+        for (; p < e && *p != ' '; p++)
+            ;
+        m->par[m->npar].n = p - m->par[m->npar].p;
+        m->npar++;
+    }
+    return 1;
+}
+
+/* Look up tag key in m, unescaping its value into v (of size n). */
+static int
+mtag(const struct Msg *m, const char *key, char *v, size_t n)
+{
+    char *p = m->tags.p, *e = p + m->tags.n, *t;
+    size_t kl = strlen(key), i = 0;
+
+    for (; p < e; p = t + 1) {
+        if (!(t = memchr(p, ';', e - p)))
+            t = e;
+        if ((size_t)(t - p) < kl || memcmp(p, key, kl) || (p + kl < t && p[kl] != '='))
+            continue;
+        for (p += kl + 1; p < t && i + 1 < n; p++) {
+            if (*p == '\\' && p + 1 < t) {
+                switch (*++p) {
+                case ':': v[i++] = ';'; break;
+                case 's': v[i++] = ' '; break;
+                case 'r': v[i++] = '\r'; break;
+                case 'n': v[i++] = '\n'; break;
+                default:  v[i++] = *p; break;
+                }
+            } else
+                v[i++] = *p;
+        }
+        if (n)
+            v[i] = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Whether a failed read or write on the server only has to be retried. */
+static int
+sagain(int r)
+{
+    if (srv->tls) {
+        r = SSL_get_error(srv->ssl, r);
+        return r == SSL_ERROR_WANT_READ || r == SSL_ERROR_WANT_WRITE;
+    }
+    return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/* Read and handle what the server sent. Over TLS, keep going until
+ * OpenSSL holds nothing more: epoll cannot see what it buffered. */
+static int
+srd(void)
+{
+    static struct Msg msg;
+    char *l, *s, *p, *e;
+    long long rx;
+    int rd, nl;
+
+    do {
+        if (srv->inb.len == srv->inb.sz) { /* Line does not fit, grow rather than drop it. */
+            if (srv->inb.sz >= InMax) {
+                srv->inb.len = 0;
+                srv->inb.skip = 1;
+                ntext(NetNote, "Input line longer than %d bytes, dropped", InMax);
+            } else {
+                srv->inb.sz = srv->inb.sz ? srv->inb.sz * 2 : InSz;
+                if (!(srv->inb.buf = realloc(srv->inb.buf, srv->inb.sz)))
+                    panic("out of memory");
+            }
+        }
+        p = srv->inb.buf + srv->inb.len; /* Bytes before p hold no newline. */
+        if (srv->tls)
+            rd = SSL_read(srv->ssl, p, srv->inb.sz - srv->inb.len);
+        else
+            rd = read(srv->fd, p, srv->inb.sz - srv->inb.len);
+        if (rd <= 0)
+            return sagain(rd);
+        srv->rxt = rx = nsec();
+        l = srv->inb.buf;
+        e = p + rd;
+        for (nl = 0; (s = memchr(p, '\n', e - p)); p = l = s + 1, nl++) { /* Cycle on all received lines. */
+            if (srv->inb.skip) {
+                srv->inb.skip = 0;
+                continue;
+            }
+            if (s > l && s[-1] == '\r')
+                s[-1] = 0;
+            *s = 0;
+            utf8repair(l, s);
+            if (mparse(l, s > l && !s[-1] ? s - 1 : s, &msg))
+                nrecv(&msg, l, s, rx);
+        }
+        if (nl)
+            hadd(&stats.h[StParse], (nsec() - rx) / nl, nl);
+        __atomic_fetch_add(&stats.rxb, rd, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.rxl, nl, __ATOMIC_RELAXED);
+        srv->inb.len = e - l;
+        if (srv->inb.skip)
+            srv->inb.len = 0;
+        else if (l != srv->inb.buf && srv->inb.len)
+            memmove(srv->inb.buf, l, srv->inb.len); /* Compact once per read. */
+    } while (srv->tls && SSL_has_pending(srv->ssl));
+    return 1;
+}
+
+/* Close a descriptor the network thread may be waiting on. */
+static void
+sclose(int fd)
+{
+    pdrop(&nt.pl, fd);
+    close(fd);
+}
+
+static void
+hangup(void)
+{
+    int i;
+
+    srv->sq.wire.beg = srv->sq.wire.end = 0; /* A partly written line is lost. */
+    srv->st = ConnDown;
+    srv->reg = 0;
+    srv->ping = 0;
+    ntext(NetStatus, "connecting");
+    ntext(NetLag, "-1");
+    if (srv->ssl) {
+        SSL_shutdown(srv->ssl);
+        SSL_free(srv->ssl);
+        srv->ssl = 0;
+    }
+    if (srv->fd) {
+        sclose(srv->fd);
+        srv->fd = 0;
+    }
+    for (i = 0; i < srv->next; i++)
+        if (srv->afd[i] >= 0)
+            sclose(srv->afd[i]);
+    srv->na = srv->next = 0;
+    if (srv->res) {
+        freeaddrinfo(srv->res);
+        srv->res = 0;
+    }
+}
+
+/* Keep a copy of each new session: the connection's own is marked
+ * unresumable if the link drops without a clean shutdown. */
+static int
+snewsess(SSL *ssl, SSL_SESSION *sess)
+{
+    struct Srv *s = SSL_get_app_data(ssl);
+
+    if (s->sess)
+        SSL_SESSION_free(s->sess);
+    s->sess = SSL_SESSION_dup(sess);
+    return 0;
+}
+
+/* One context for the whole run, so sessions can be resumed. */
+static void
+sctx(void)
+{
+    SSL_load_error_strings();
+    SSL_library_init();
+    sslctx = SSL_CTX_new(SSLv23_client_method());
+    if (!sslctx)
+        panic("Could not initialize ssl context.");
+    SSL_CTX_set_session_cache_mode(sslctx,
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(sslctx, snewsess);
+    SSL_CTX_set_read_ahead(sslctx, 1); /* Fewer, larger reads. */
+#if KTLS && defined(SSL_OP_ENABLE_KTLS)
+    SSL_CTX_set_options(sslctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+static void *
+resolve(void *arg)
+{
+    struct Srv *s = arg;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;     /* allow IPv4 or IPv6 */
+    hints.ai_flags = AI_NUMERICSERV; /* avoid name lookup for port */
+    hints.ai_socktype = SOCK_STREAM;
+    s->gai = getaddrinfo(s->host, s->port, &hints, &s->res);
+    write(s->wake[1], "", 1);
+    return 0;
+}
+
+/* Start connecting; the event loop drives the rest through sstep(). */
+static void
+sconnect(void)
+{
+    if (!srv->wake[1] && pipe(srv->wake) < 0)
+        panic("cannot create pipe");
+    if (pthread_create(&srv->thr, 0, resolve, srv))
+        panic("cannot start resolver");
+    srv->st = ConnResolve;
+}
+
+/* Give up on this attempt, and retry later. Once retries run out, give
+ * up on the server, and on the whole once no other is left. */
+static void
+sfail(const char *m)
+{
+    struct Srv *s;
+
+    hangup();
+    if (!srv->up || srv->tries++ == MaxRecons) {
+        srv->dead = 1;
+        for (s = srvs; s < srvs + nsrv && s->dead; s++)
+            ;
+        if (s < srvs + nsrv) {
+            ntext(NetNote, "%s, giving up on %s", srv->up ? "Link lost" : m, srv->host);
+            ntext(NetStatus, "down");
+            return;
+        }
+        ntext(NetFatal, "%s", srv->up ? "link lost" : m);
+        nt.dead = 1;
+        return;
+    }
+    ntext(NetNote, "%s", m);
+    srv->t = nsec() + RetryDelay * 1000000000LL;
+}
+
+/* The link went down: back off as for a failed attempt, counting it
+ * unless the link had stayed up long enough. */
+static void
+slost(const char *m)
+{
+    if (nsec() - srv->tup >= StableUp * 1000000000LL)
+        srv->tries = 0;
+    sfail(m);
+}
+
+static void
+sup(void)
+{
+    if (srv->ssl)
+        SSL_set_mode(srv->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE
+            | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    srv->st = ConnUp;
+    srv->up = 1;
+    srv->tup = nsec();
+    srv->sq.tok = FLOODBURST; /* The server counts afresh. */
+    srv->sq.tokt = srv->rxt = nsec();
+    if (srv->tls)
+        ntext(NetStatus, "%s %lldms%s", SSL_get_version(srv->ssl),
+            srv->ths / 1000000, srv->resumed ? " resumed" : "");
+    else
+        ntext(NetStatus, "");
+    ntext(NetUp, "");
+}
+
+static void
+stls(void)
+{
+    int r;
+
+    if ((r = SSL_connect(srv->ssl)) == 1) {
+        srv->ths = nsec() - srv->ths;
+        srv->resumed = SSL_session_reused(srv->ssl);
+        ntext(NetNote, "%s handshake took %lld ms%s", SSL_get_version(srv->ssl),
+            srv->ths / 1000000, srv->resumed ? ", session resumed" : "");
+        sup();
+        return;
+    }
+    srv->want = SSL_get_error(srv->ssl, r);
+    if (srv->want != SSL_ERROR_WANT_READ && srv->want != SSL_ERROR_WANT_WRITE)
+        sfail("Could not connect with ssl.");
+}
+
+/* Connection attempt i went through. */
+static void
+swon(int i)
+{
+    srv->fd = srv->afd[i];
+    srv->afd[i] = -1;
+    for (i = 0; i < srv->next; i++)
+        if (srv->afd[i] >= 0)
+            sclose(srv->afd[i]);
+    srv->na = srv->next = 0;
+    freeaddrinfo(srv->res);
+    srv->res = 0;
+    if (!srv->tls) {
+        sup();
+        return;
+    }
+    srv->ssl = SSL_new(sslctx);
+    SSL_set_app_data(srv->ssl, srv);
+    if (srv->sess)
+        SSL_set_session(srv->ssl, srv->sess);
+    srv->ths = nsec();
+    if (SSL_set_fd(srv->ssl, srv->fd) == 0) {
+        sfail("Could not connect with ssl.");
+        return;
+    }
+    srv->st = ConnTls;
+    stls();
+}
+
+/* Order the addresses as Happy Eyeballs does, alternating between
+ * families starting with the one the resolver put first. */
+static void
+sresolved(void)
+{
+    struct addrinfo *rp, *fam[2] = {0}, *q;
+    int f, n = 0;
+    char c;
+
+    read(srv->wake[0], &c, 1);
+    pthread_join(srv->thr, 0);
+    if (srv->gai) {
+        srv->res = 0;
+        sfail("Getaddrinfo failed.");
+        return;
+    }
+    for (rp = srv->res; rp; rp = rp->ai_next)
+        if (!fam[0] || rp->ai_family == fam[0]->ai_family) {
+            if (!fam[0])
+                fam[0] = rp;
+        } else if (!fam[1])
+            fam[1] = rp;
+    for (f = 0; n < MaxAddrs && (fam[0] || fam[1]); f ^= 1) {
+        if (!(q = fam[f]))
+            continue;
+        srv->addr[n++] = q;
+        for (q = q->ai_next; q && q->ai_family != fam[f]->ai_family; q = q->ai_next)
+            ;
+        fam[f] = q;
+    }
+    srv->na = n;
+    srv->next = 0;
+    srv->tnext = 0;
+    srv->st = ConnDial;
+    srv->t = nsec() + ConnTimeout * 1000000000LL;
+}
+
+/* Start a connection attempt to the next address. */
+static void
+sattempt(void)
+{
+    struct addrinfo *rp;
+    int fd, i;
+
+    while ((i = srv->next) < srv->na) {
+        rp = srv->addr[srv->next++];
+        srv->afd[i] = -1;
+        if ((fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1)
+            continue;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        srv->afd[i] = fd;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            swon(i);
+            return;
+        }
+        if (errno == EINPROGRESS) {
+            srv->tnext = nsec() + ConnDelay * 1000000LL;
+            return;
+        }
+        close(fd);
+        srv->afd[i] = -1;
+    }
+}
+
+/* Wait for what connection setup waits for. */
+static void
+sfds(long long *tmo)
+{
+    long long now = nsec(), d;
+    int i;
+
+    switch (srv->st) {
+    case ConnResolve:
+        pwant(&nt.pl, srv->wake[0], EPOLLIN);
+        break;
+    case ConnDial:
+        for (i = 0; i < srv->next; i++)
+            if (srv->afd[i] >= 0)
+                pwant(&nt.pl, srv->afd[i], EPOLLOUT);
+        if (srv->next < srv->na && srv->tnext - now < *tmo)
+            *tmo = srv->tnext - now;
+        break;
+    case ConnTls:
+        pwant(&nt.pl, srv->fd, srv->want == SSL_ERROR_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+        break;
+    }
+    if (srv->st != ConnResolve && (d = srv->t - now) < *tmo)
+        *tmo = d; /* The resolver cannot be timed out, wait for it. */
+    if (*tmo < 0)
+        *tmo = 0;
+}
+
+/* Move connection setup along after pwait(). */
+static void
+sstep(void)
+{
+    int i, e, live = 0;
+    socklen_t l;
+
+    switch (srv->st) {
+    case ConnDown:
+        if (nsec() >= srv->t)
+            sconnect();
+        return;
+    case ConnResolve:
+        if (pready(&nt.pl, srv->wake[0], EPOLLIN))
+            sresolved();
+        return;
+    case ConnDial:
+        for (i = 0; i < srv->next; i++) {
+            if (srv->afd[i] < 0)
+                continue;
+            if (!pready(&nt.pl, srv->afd[i], EPOLLOUT)) {
+                live++;
+                continue;
+            }
+            l = sizeof e;
+            if (getsockopt(srv->afd[i], SOL_SOCKET, SO_ERROR, &e, &l) == 0 && !e) {
+                swon(i);
+                return;
+            }
+            sclose(srv->afd[i]);
+            srv->afd[i] = -1;
+        }
+        if (srv->next < srv->na && (!live || nsec() >= srv->tnext)) {
+            sattempt();
+            if (srv->st != ConnDial)
+                return;
+            for (live = 0, i = 0; i < srv->next; i++)
+                live += srv->afd[i] >= 0;
+        }
+        if (!live)
+            sfail("Cannot connect to host.");
+        else if (nsec() >= srv->t)
+            sfail("Connection timed out.");
+        return;
+    case ConnTls:
+        if (nsec() >= srv->t)
+            sfail("Ssl handshake timed out.");
+        else if (pready(&nt.pl, srv->fd, srv->want == SSL_ERROR_WANT_WRITE ? EPOLLOUT : EPOLLIN))
+            stls();
+        return;
+    }
+}
+
+/* Send our PINGs once registered, and give the link up when neither
+ * their PONGs nor anything else came back for PINGTMO seconds: a
+ * half-open connection is otherwise silent. Returns the ns until the
+ * next check. */
+static long long
+skeep(void)
+{
+    long long now = nsec(), d;
+    char b[64];
+    int n;
+
+    if (srv->ping) {
+        d = (srv->ping > srv->rxt ? srv->ping : srv->rxt) + PINGTMO * 1000000000LL - now;
+        if (d > 0)
+            return d;
+        snprintf(b, sizeof b, "No reply in %d seconds, reconnecting...", PINGTMO);
+        slost(b);
+        return 0;
+    }
+    if (!srv->reg)
+        return 5000000000LL;
+    if ((d = srv->pingt - now) > 0)
+        return d;
+    n = snprintf(b, sizeof b, "PING :icyrc-%lld\r\n", now);
+    sput(b, n);
+    srv->ping = now;
+    srv->pingt = now + PINGIVL * 1000000000LL;
+    return PINGTMO * 1000000000LL;
+}
+
+/* Write what the send queue let through. */
+static void
+swrite(void)
+{
+    char *p = srv->sq.wire.buf + srv->sq.wire.beg, *e;
+    size_t n = srv->sq.wire.end - srv->sq.wire.beg;
+    int wr;
+
+    if (srv->tls)
+        wr = SSL_write(srv->ssl, p, n);
+    else
+        wr = write(srv->fd, p, n);
+    if (wr > 0) {
+        for (e = p; (e = memchr(e, '\n', p + wr - e)); e++)
+            __atomic_fetch_add(&stats.txl, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.txb, wr, __ATOMIC_RELAXED);
+        lpop(&srv->sq.wire, wr);
+    } else if (!sagain(wr))
+        slost("Link lost, reconnecting...");
+}
+
+/* The network thread: connections, reads, parsing, PONGs and the send
+ * queues, for every server. It never waits on the UI, which it feeds
+ * through nt.in. */
+static void *
+nthread(void *arg)
+{
+    unsigned long q;
+    char c[64];
+
+    (void)arg;
+    for (srv = srvs; srv < srvs + nsrv; srv++)
+        sconnect();
+    while (!__atomic_load_n(&nt.quit, __ATOMIC_ACQUIRE) && !nt.dead) {
+        long long tmo = 5000000000LL, d;
+
+        pwant(&nt.pl, nt.wake[0], EPOLLIN);
+        for (srv = srvs; srv < srvs + nsrv; srv++) {
+            if (srv->dead)
+                continue;
+            if (srv->st == ConnUp && (d = skeep()) < tmo)
+                tmo = d;
+            if ((srv->on = srv->st == ConnUp)) {
+                if ((d = sqpump()) >= 0 && d < tmo)
+                    tmo = d;
+                pwant(&nt.pl, srv->fd, EPOLLIN
+                    | (srv->sq.wire.beg != srv->sq.wire.end ? EPOLLOUT : 0));
+            } else
+                sfds(&tmo);
+        }
+        if (nt.ovf.beg != nt.ovf.end)
+            tmo = 10000000; /* Poll until the UI catches up. */
+        if (pwait(&nt.pl, tmo) < 0) {
+            if (errno == EINTR)
+                continue;
+            ntext(NetFatal, "epoll failed");
+            break;
+        }
+        if (pready(&nt.pl, nt.wake[0], EPOLLIN)) {
+            read(nt.wake[0], c, sizeof c);
+            sintake();
+        }
+        novf();
+        for (q = 0, srv = srvs; srv < srvs + nsrv; srv++) {
+            if (srv->dead)
+                continue;
+            if (!srv->on)
+                sstep();
+            else if (pready(&nt.pl, srv->fd, EPOLLIN) && !srd())
+                slost("Link lost, reconnecting...");
+            else if (pready(&nt.pl, srv->fd, EPOLLOUT))
+                swrite();
+            q += srv->sq.wire.end - srv->sq.wire.beg
+                + srv->sq.lane[LaneCtl].end - srv->sq.lane[LaneCtl].beg
+                + srv->sq.lane[LaneBulk].end - srv->sq.lane[LaneBulk].beg;
+        }
+        __atomic_store_n(&stats.outq, q, __ATOMIC_RELAXED);
+        if (nt.pend) {
+            nt.pend = 0;
+            write(nt.uiwake[1], "", 1);
+        }
+    }
+    sintake();
+    for (srv = srvs; srv < srvs + nsrv; srv++) {
+        if (srv->st == ConnUp) { /* Try to get a QUIT out. */
+            sqpump();
+            if (srv->sq.wire.beg != srv->sq.wire.end) {
+                if (srv->tls)
+                    SSL_write(srv->ssl, srv->sq.wire.buf + srv->sq.wire.beg, srv->sq.wire.end - srv->sq.wire.beg);
+                else
+                    write(srv->fd, srv->sq.wire.buf + srv->sq.wire.beg, srv->sq.wire.end - srv->sq.wire.beg);
+            }
+        }
+        hangup();
+    }
+    write(nt.uiwake[1], "", 1);
+    return 0;
+}
+
+/* The formatted timestamps for t, from the thread's cache c. */
+static const struct Stamp *
+stamp(struct Stamp *c, time_t t)
+{
+    struct Stamp *s = &c[(unsigned long)t % StampCache];
+    struct tm tm;
+
+    if (s->t == t && *s->utc)
+        return s;
+    s->t = t;
+    gmtime_r(&t, &tm);
+    if (snprintf(s->utc, sizeof s->utc, "%04d-%02d-%02dT%02d:%02d:%02dZ",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+        tm.tm_hour, tm.tm_min, tm.tm_sec) >= (int)sizeof s->utc)
+        strcpy(s->utc, "?"); /* Past year 9999. */
+#ifdef DATEFMT
+    localtime_r(&t, &tm);
+    s->nloc = strftime(s->loc, sizeof s->loc, DATEFMT, &tm);
+#endif
+    return s;
+}
+
+/* Queue a log record; never blocks, drops it if the writer is behind. */
+static void
+logpush(const char *chan, time_t t, const char *msg, long long rx)
+{
+    size_t cl = strlen(chan), ml = strlen(msg), need;
+    unsigned long used = lg.q.head - __atomic_load_n(&lg.q.tail, __ATOMIC_ACQUIRE);
+    struct LogRec *r;
+
+    need = (sizeof *r + cl + ml + 2 + 7) & ~(size_t)7;
+    if (!(r = rget(&lg.q, need))) {
+        lg.drops++;
+        return;
+    }
+    r->len = need;
+    r->clen = cl;
+    r->t = t;
+    r->lt = tnow;
+    r->rx = rx;
+    memcpy(r->data, chan, cl + 1);
+    memcpy(r->data + cl + 1, msg, ml + 1);
+    rput(&lg.q, need);
+    if (used < LogRing / 2 && used + need >= LogRing / 2)
+        write(lg.wake[1], "", 1);
+}
+
+static int
+logopen(struct LogFile *f)
+{
+    char path[PATH_MAX], *p;
+    struct stat st;
+
+    if (lg.perchan) {
+        snprintf(path, sizeof path, "%s/%s", lg.path, f->name);
+        for (p = path + strlen(lg.path) + 1; *p; p++)
+            if (*p == '/')
+                *p = '_';
+    } else
+        snprintf(path, sizeof path, "%s", lg.path);
+    if ((f->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) < 0)
+        return -1;
+    f->sz = fstat(f->fd, &st) ? 0 : st.st_size;
+    f->day = time(0) / 86400;
+    return 0;
+}
+
+static void
+logwrite(struct LogFile *f)
+{
+    size_t o = 0;
+    ssize_t n;
+
+    while (o < f->len) {
+        if ((n = write(f->fd, f->buf + o, f->len - o)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break; /* Nowhere to report it, give the batch up. */
+        }
+        o += n;
+    }
+    f->sz += f->len;
+    f->len = 0;
+    if (LOGSYNC == SyncBatch)
+        fsync(f->fd);
+}
+
+/* Move the log aside once it is too big or from another day. */
+static void
+logrotate(struct LogFile *f, time_t t, size_t n)
+{
+    char path[PATH_MAX], old[PATH_MAX];
+    struct tm tm;
+    int i, o;
+
+    if (!(LOGDAILY && t / 86400 != f->day) && !(LOGMAXSZ && f->sz + f->len + n > LOGMAXSZ))
+        return;
+    if (f->len)
+        logwrite(f);
+    close(f->fd);
+    if (lg.perchan)
+        snprintf(path, sizeof path, "%s/%s", lg.path, f->name);
+    else
+        snprintf(path, sizeof path, "%s", lg.path);
+    gmtime_r(&t, &tm);
+    o = snprintf(old, sizeof old, "%s.%04d-%02d-%02dT%02d%02d%02d", path,
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    for (i = 1; !access(old, F_OK) && o < (int)sizeof old; i++)
+        snprintf(old + o, sizeof old - o, ".%d", i); /* Rotated twice a second. */
+    rename(path, old);
+    logopen(f);
+}
+
+static struct LogFile *
+logfile(const char *chan)
+{
+    struct LogFile *f;
+    int i;
+
+    for (i = 0; i < lg.nf; i++)
+        if (!lg.perchan || !strcmp(lg.f[i].name, chan))
+            return lg.f[i].fd < 0 ? 0 : &lg.f[i];
+    if (!(f = realloc(lg.f, (lg.nf + 1) * sizeof *f)))
+        return 0;
+    lg.f = f;
+    f = &lg.f[lg.nf];
+    memset(f, 0, sizeof *f);
+    strcpy(f->name, chan);
+    if (!(f->buf = malloc(LogBuf)) || logopen(f) < 0)
+        f->fd = -1;
+    lg.nf++;
+    return f->fd < 0 ? 0 : f;
+}
+
+static int
+ilopen(const char *name, int flags)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof path, "%s/%s", lg.ipath, name);
+    return open(path, flags, 0600);
+}
+
+static void
+ilput(int fd, const void *b, size_t n)
+{
+    size_t o = 0;
+    ssize_t w;
+
+    while (o < n) {
+        if ((w = write(fd, (char *)b + o, n - o)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        o += w;
+    }
+    if (LOGSYNC == SyncBatch)
+        fsync(fd);
+}
+
+static void
+ilflush(void)
+{
+    int i;
+
+    ilput(lg.lfd, lg.lbuf, lg.llen); /* Log first, so no index points past it. */
+    ilput(lg.xfd, lg.xbuf, lg.xlen);
+    lg.llen = lg.xlen = 0;
+    for (i = 0; i < lg.nci; i++)
+        if (lg.ci[i].n) {
+            ilput(lg.ci[i].fd, lg.ci[i].x, lg.ci[i].n * sizeof *lg.ci[i].x);
+            lg.ci[i].n = 0;
+        }
+}
+
+/* The index of channels hashing to h, opened on first use. */
+static struct ChanIdx *
+ilchan(uint32_t h)
+{
+    struct ChanIdx *c;
+    struct stat st;
+    char name[32];
+    int i;
+
+    for (i = 0; i < lg.nci; i++)
+        if (lg.ci[i].chan == h)
+            return lg.ci[i].fd < 0 ? 0 : &lg.ci[i];
+    if (!(c = realloc(lg.ci, (lg.nci + 1) * sizeof *c)))
+        return 0;
+    lg.ci = c;
+    c = &lg.ci[lg.nci++];
+    c->chan = h;
+    c->n = 0;
+    snprintf(name, sizeof name, "%s/%08x", ILOG_CHAN, (unsigned)h);
+    if ((c->fd = ilopen(name, O_WRONLY | O_APPEND | O_CREAT)) < 0)
+        return 0;
+    if (fstat(c->fd, &st) == 0 && st.st_size % sizeof *c->x) /* Cut short by a crash. */
+        ftruncate(c->fd, st.st_size - st.st_size % sizeof *c->x);
+    return c;
+}
+
+/* Add x to the index of its channel. */
+static void
+ilcadd(const struct IlogIdx *x)
+{
+    struct ChanIdx *c;
+
+    if (!(c = ilchan(x->chan)))
+        return;
+    if (c->n == sizeof c->x / sizeof *c->x)
+        ilflush();
+    c->x[c->n++] = *x;
+}
+
+/* Index by channel a log from before the per-channel indexes. */
+static void
+ilsplit(void)
+{
+    struct IlogIdx x[256];
+    ssize_t n;
+    int fd, i;
+
+    if ((fd = ilopen(ILOG_IDX, O_RDONLY)) < 0)
+        return;
+    while ((n = read(fd, x, sizeof x)) >= (ssize_t)sizeof *x)
+        for (i = 0; i < n / (ssize_t)sizeof *x; i++)
+            ilcadd(&x[i]);
+    close(fd);
+    ilflush();
+}
+
+static void
+ilwrite(struct LogRec *r)
+{
+    struct IlogRec h;
+    struct IlogIdx x;
+    char *m = r->data + r->clen + 1;
+    size_t ml = strlen(m);
+
+    if (ml > UINT16_MAX)
+        ml = UINT16_MAX;
+    h.len = sizeof h + r->clen + ml;
+    h.clen = r->clen;
+    h.mlen = ml;
+    h.t = r->t;
+    if (lg.llen + h.len > LogBuf || lg.xlen + sizeof x > LogBuf)
+        ilflush();
+    x.chan = ilhash(r->data, r->clen);
+    x.len = h.len;
+    x.t = lg.xt = r->lt > lg.xt ? r->lt : lg.xt; /* Keep it sorted. */
+    x.off = lg.loff;
+    memcpy(lg.lbuf + lg.llen, &h, sizeof h);
+    memcpy(lg.lbuf + lg.llen + sizeof h, r->data, r->clen);
+    memcpy(lg.lbuf + lg.llen + sizeof h + r->clen, m, ml);
+    lg.llen += h.len;
+    lg.loff += h.len;
+    memcpy(lg.xbuf + lg.xlen, &x, sizeof x);
+    lg.xlen += sizeof x;
+    ilcadd(&x);
+}
+
+static void
+logdrain(void)
+{
+    unsigned long h = __atomic_load_n(&lg.q.head, __ATOMIC_ACQUIRE);
+    struct LogRec *r;
+    struct LogFile *f;
+    char l[LineLen + 64];
+    int i, n;
+
+    /* What was queued by now, so that a busy queue still gets flushed. */
+    for (; (long)(h - lg.q.tail) > 0 && (r = rnext(&lg.q)); rdone(&lg.q, r)) {
+        if (r->rx)
+            latadd(&lg.lat, r->rx);
+        if (lg.ipath)
+            ilwrite(r);
+        if (!lg.path)
+            continue;
+        n = snprintf(l, sizeof l, "%-12.12s\t%s\t%s\n", r->data,
+            stamp(lg.stamp, r->t)->utc, r->data + r->clen + 1);
+        if (n >= (int)sizeof l)
+            n = sizeof l - 1;
+        if (!(f = logfile(r->data)))
+            continue;
+        logrotate(f, r->lt, n);
+        if (f->len + n > LogBuf)
+            logwrite(f);
+        memcpy(f->buf + f->len, l, n);
+        f->len += n;
+    }
+    for (i = 0; i < lg.nf; i++)
+        if (lg.f[i].len)
+            logwrite(&lg.f[i]);
+    if (lg.llen)
+        ilflush();
+    latdone(&lg.lat, &lat.log);
+    if (LOGSYNC == SyncInterval && time(0) - lg.synct >= LOGSYNCIVL) {
+        for (i = 0; i < lg.nf; i++)
+            if (lg.f[i].fd >= 0)
+                fsync(lg.f[i].fd);
+        if (lg.ipath)
+            fsync(lg.lfd), fsync(lg.xfd);
+        for (i = 0; i < lg.nci; i++)
+            if (lg.ci[i].fd >= 0)
+                fsync(lg.ci[i].fd);
+        lg.synct = time(0);
+    }
+}
+
+static void *
+logthread(void *arg)
+{
+    struct timeval tv;
+    fd_set rfs;
+    char b[64];
+
+    (void)arg;
+    while (!__atomic_load_n(&lg.quit, __ATOMIC_ACQUIRE)) {
+        FD_ZERO(&rfs);
+        FD_SET(lg.wake[0], &rfs);
+        tv.tv_sec = LOGFLUSH / 1000;
+        tv.tv_usec = LOGFLUSH % 1000 * 1000;
+        if (select(lg.wake[0] + 1, &rfs, 0, 0, &tv) > 0)
+            read(lg.wake[0], b, sizeof b);
+        logdrain();
+    }
+    logdrain();
+    return 0;
+}
+
+static void
+loginit(char *path, char *ipath)
+{
+    char cpath[PATH_MAX];
+    struct stat st;
+
+    if ((lg.path = path)) {
+        lg.perchan = !stat(path, &st) && S_ISDIR(st.st_mode);
+        if (!lg.perchan && !logfile(""))
+            panic("cannot open logfile");
+    }
+    if ((lg.ipath = ipath)) {
+        mkdir(ipath, 0700);
+        if ((lg.lfd = ilopen(ILOG_LOG, O_WRONLY | O_APPEND | O_CREAT)) < 0
+        || (lg.xfd = ilopen(ILOG_IDX, O_WRONLY | O_APPEND | O_CREAT)) < 0
+        || fstat(lg.lfd, &st) < 0)
+            panic("cannot open indexed log");
+        lg.loff = st.st_size;
+        if (fstat(lg.xfd, &st) == 0 && st.st_size % sizeof(struct IlogIdx))
+            ftruncate(lg.xfd, st.st_size - st.st_size % sizeof(struct IlogIdx));
+        if (!(lg.lbuf = malloc(LogBuf)) || !(lg.xbuf = malloc(LogBuf)))
+            panic("out of memory");
+        snprintf(cpath, sizeof cpath, "%s/%s", ipath, ILOG_CHAN);
+        if (!mkdir(cpath, 0700))
+            ilsplit();
+    }
+    rinit(&lg.q, LogRing);
+    if (pipe(lg.wake) < 0 || fcntl(lg.wake[1], F_SETFL, O_NONBLOCK) < 0)
+        panic("cannot create pipe");
+    lg.synct = time(0);
+    if (pthread_create(&lg.thr, 0, logthread, 0))
+        panic("cannot start log writer");
+}
+
+static void
+logstop(void)
+{
+    int i;
+
+    if (!lg.q.q)
+        return;
+    __atomic_store_n(&lg.quit, 1, __ATOMIC_RELEASE);
+    write(lg.wake[1], "", 1);
+    pthread_join(lg.thr, 0);
+    close(lg.wake[0]);
+    close(lg.wake[1]);
+    for (i = 0; i < lg.nf; i++) {
+        if (lg.f[i].fd >= 0)
+            close(lg.f[i].fd);
+        free(lg.f[i].buf);
+    }
+    free(lg.f);
+    free(lg.q.q);
+    if (lg.ipath) {
+        close(lg.lfd);
+        close(lg.xfd);
+        free(lg.lbuf);
+        free(lg.xbuf);
+        for (i = 0; i < lg.nci; i++)
+            if (lg.ci[i].fd >= 0)
+                close(lg.ci[i].fd);
+        free(lg.ci);
+    }
+}
+
+/* Queue a highlight for the notifier; drops it if that is behind. */
+static void
+ntfpush(int srv, const char *usr, const char *chan, const char *msg)
+{
+    size_t ul = strlen(usr), cl = strlen(chan), ml = strlen(msg), need;
+    struct NoteRec *r;
+
+    if (ml > LineLen)
+        ml = LineLen;
+    need = (sizeof *r + ul + cl + ml + 3 + 7) & ~7;
+    if (!ntf.q.q || !(r = rget(&ntf.q, need)))
+        return;
+    r->len = need;
+    r->srv = srv;
+    r->ul = ul;
+    r->cl = cl;
+    memcpy(r->data, usr, ul + 1);
+    memcpy(r->data + ul + 1, chan, cl + 1);
+    memcpy(r->data + ul + cl + 2, msg, ml);
+    r->data[ul + cl + 2 + ml] = 0;
+    rput(&ntf.q, need);
+    write(ntf.wake[1], "", 1);
+}
+
+/* Run NOTIFYCMD with a title and a body, without a shell. */
+static void
+ntfspawn(char *title, char *body)
+{
+    extern char **environ;
+    char *argv[] = {NOTIFYCMD, title, body, 0};
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 2, "/dev/null", O_WRONLY, 0);
+    if (posix_spawnp(&pid, argv[0], &fa, 0, argv, environ) == 0)
+        ntf.kids++;
+    posix_spawn_file_actions_destroy(&fa);
+}
+
+/* Send what was held back for c: the highlight itself if there was one,
+ * a count if there were more. */
+static void
+ntfflush(struct Note *c, long long now)
+{
+    char b[64], t[LogName];
+
+    if (c->n == 1)
+        ntfspawn(c->last, c->last + c->tl + 1);
+    else if (c->n > 1) {
+        snprintf(b, sizeof b, "%d highlights in %s", c->n, c->chan);
+        snprintf(t, sizeof t, "%.255s%s%s", nsrv > 1 ? srvs[c->srv].host : "",
+            nsrv > 1 ? "/" : "", c->chan);
+        ntfspawn(t, b);
+    }
+    c->n = 0;
+    c->t = now;
+}
+
+static void
+ntfdrain(void)
+{
+    long long now = nsec();
+    struct NoteRec *r;
+    struct Note *c;
+    char *chan, *msg;
+    int i;
+
+    while ((r = rnext(&ntf.q))) {
+        chan = r->data + r->ul + 1;
+        msg = chan + r->cl + 1;
+        for (i = 0; i < ntf.nc && (ntf.c[i].srv != (int)r->srv
+        || !ilsame(ntf.c[i].chan, strlen(ntf.c[i].chan), chan, r->cl)); i++)
+            ;
+        if (i == ntf.nc) {
+            if (!(c = realloc(ntf.c, (ntf.nc + 1) * sizeof *c)))
+                panic("out of memory");
+            ntf.c = c;
+            c = &ntf.c[ntf.nc++];
+            c->srv = r->srv;
+            snprintf(c->chan, sizeof c->chan, "%s", chan);
+            c->t = now - NOTIFYIVL * 1000000000LL;
+            c->n = 0;
+        }
+        c = &ntf.c[i];
+        c->tl = snprintf(c->last, sizeof c->last, "%s @ %s%s%s", r->data, chan,
+            nsrv > 1 ? " on " : "", nsrv > 1 ? srvs[c->srv].host : "");
+        if (c->tl >= sizeof c->last - 1)
+            c->tl = sizeof c->last - 2;
+        snprintf(c->last + c->tl + 1, sizeof c->last - c->tl - 1, "%s", msg);
+        c->n++;
+        rdone(&ntf.q, r);
+    }
+    for (c = ntf.c; c < ntf.c + ntf.nc; c++)
+        if (c->n && now - c->t >= NOTIFYIVL * 1000000000LL)
+            ntfflush(c, now);
+    while (ntf.kids && waitpid(-1, 0, WNOHANG) > 0)
+        ntf.kids--;
+}
+
+/* The notifier: at most one notification per channel of each server
+ * every NOTIFYIVL seconds, highlights in between are coalesced into the
+ * next one. */
+static void *
+ntfthread(void *arg)
+{
+    long long d, now;
+    struct timeval tv;
+    struct Note *c;
+    fd_set rfs;
+    char b[64];
+
+    (void)arg;
+    while (!__atomic_load_n(&ntf.quit, __ATOMIC_ACQUIRE)) {
+        d = ntf.kids ? 1000000000LL : 60000000000LL; /* Reap now and then. */
+        now = nsec();
+        for (c = ntf.c; c < ntf.c + ntf.nc; c++)
+            if (c->n && c->t + NOTIFYIVL * 1000000000LL - now < d)
+                d = c->t + NOTIFYIVL * 1000000000LL - now;
+        if (d < 0)
+            d = 0;
+        tv.tv_sec = d / 1000000000;
+        tv.tv_usec = d % 1000000000 / 1000;
+        FD_ZERO(&rfs);
+        FD_SET(ntf.wake[0], &rfs);
+        if (select(ntf.wake[0] + 1, &rfs, 0, 0, &tv) > 0)
+            read(ntf.wake[0], b, sizeof b);
+        ntfdrain();
+    }
+    return 0;
+}
+
+static void
+ntfinit(void)
+{
+    rinit(&ntf.q, NoteRing);
+    if (pipe(ntf.wake) < 0)
+        panic("cannot create pipe");
+    fcntl(ntf.wake[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&ntf.thr, 0, ntfthread, 0))
+        panic("cannot start notifier");
+}
+
+static void
+ntfstop(void)
+{
+    if (!ntf.q.q)
+        return;
+    __atomic_store_n(&ntf.quit, 1, __ATOMIC_RELEASE);
+    write(ntf.wake[1], "", 1);
+    pthread_join(ntf.thr, 0);
+    close(ntf.wake[0]);
+    close(ntf.wake[1]);
+    free(ntf.c);
+    free(ntf.q.q);
+}
+
+/* Hash of name on server s: each server has a namespace of its own. */
+static uint32_t
+chkey(const char *name, size_t len, int s)
+{
+    return ilhash(name, len) ^ (uint32_t)s * 0x9E3779B1u;
+}
+
+/* Slot of name in chtab, or of the empty one where it would go. */
+static size_t
+chslot(const char *name, size_t len, uint32_t h, int s)
+{
+    size_t i;
+
+    for (i = h & (chtsz - 1); chtab[i]; i = (i + 1) & (chtsz - 1))
+        if (chtab[i]->hash == h && chtab[i]->srv == s
+        && ilsame(chtab[i]->name, strlen(chtab[i]->name), name, len))
+            break;
+    return i;
+}
+
+/* Channel name on the server being handled, or its server buffer. */
+static inline int
+chfind(const char *name)
+{
+    size_t len;
+    struct Chan *c;
+
+    assert(name);
+    if (!chtsz)
+        return sbuf();
+    len = strlen(name);
+    c = chtab[chslot(name, len, chkey(name, len, us), us)];
+    return c ? c->idx : sbuf();
+}
+
+static void
+chhash(struct Chan *c)
+{
+    struct Chan **old = chtab;
+    size_t i, osz = chtsz;
+
+    if (2 * (size_t)(nch + 1) > chtsz) { /* Keep the load factor under 1/2. */
+        chtsz = chtsz ? chtsz * 2 : 64;
+        if (!(chtab = calloc(chtsz, sizeof *chtab)))
+            panic("out of memory");
+        for (i = 0; i < osz; i++)
+            if (old[i])
+                chtab[chslot(old[i]->name, strlen(old[i]->name), old[i]->hash, old[i]->srv)] = old[i];
+        free(old);
+    }
+    c->hash = chkey(c->name, strlen(c->name), c->srv);
+    chtab[chslot(c->name, strlen(c->name), c->hash, c->srv)] = c;
+}
+
+static void
+chunhash(struct Chan *c)
+{
+    size_t i, j, k;
+
+    i = chslot(c->name, strlen(c->name), c->hash, c->srv);
+    if (chtab[i] != c)
+        return;
+    chtab[i] = 0;
+    for (j = (i + 1) & (chtsz - 1); chtab[j]; j = (j + 1) & (chtsz - 1)) {
+        k = chtab[j]->hash & (chtsz - 1);
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            chtab[i] = chtab[j]; /* Shift back into the hole. */
+            chtab[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static void
+chrename(struct Chan *c, const char *name)
+{
+    vrename(c, name);
+    chunhash(c);
+    c->name[0] = 0;
+    strncat(c->name, name, ChanLen - 1);
+    chhash(c);
+}
+
+static void
+chfree(struct Chan *c)
+{
+    struct Chunk *k;
+    int i;
+
+    for (i = 0; i < c->nl; i++)
+        free(c->line[i].brk);
+    while ((k = c->head)) {
+        c->head = k->next;
+        free(k);
+    }
+    memtot -= c->mem;
+    free(c->lbuf);
+}
+
+/* Unlink the oldest chunk of c and drop the lines it held. */
+static struct Chunk *
+chevict(struct Chan *c)
+{
+    struct Chunk *k = c->head;
+    int i;
+
+    for (i = 0; i < c->nl && c->line[i].s >= k->buf
+    && c->line[i].s < k->buf + k->len; i++)
+        free(c->line[i].brk);
+    c->line += i;
+    c->nl -= i;
+    c->head = k->next;
+    c->mem -= sizeof *k;
+    memtot -= sizeof *k;
+    return k;
+}
+
+/* Get a fresh chunk for c, recycling the oldest one once over budget. */
+static struct Chunk *
+chgrow(struct Chan *c)
+{
+    struct Chunk *k = 0;
+    struct Chan *o;
+    int i;
+
+    if (c->head && c->head != c->tail && c->mem + sizeof *k > CHANMEM)
+        k = chevict(c);
+    while (!k && memtot + sizeof *k > memmax) {
+        for (o = 0, i = 0; i < nch; i++)
+            if (chl[i]->head && chl[i]->head != chl[i]->tail
+            && (!o || chl[i]->head->seq < o->head->seq))
+                o = chl[i];
+        if (!o)
+            break;
+        k = chevict(o);
+        if (o != c) {
+            free(k);
+            k = 0;
+        }
+    }
+    if (!k && !(k = malloc(sizeof *k)))
+        panic("out of memory");
+    k->next = 0;
+    k->seq = chunkseq++;
+    k->len = 0;
+    if (c->tail)
+        c->tail->next = k;
+    else
+        c->head = k;
+    c->tail = k;
+    c->mem += sizeof *k;
+    memtot += sizeof *k;
+    return k;
+}
+
+static int
+chadd(const char *name, int joined)
+{
+    struct Chan *c;
+    long long rx = trx;
+    int n;
+
+    if (strlen(name) >= ChanLen)
+        return -1;
+    if ((n = chfind(name)) != sbuf())
+        return n;
+    if (nch == chsz) {
+        chsz = chsz ? chsz * 2 : 16;
+        if (!(chl = realloc(chl, chsz * sizeof *chl)))
+            panic("out of memory");
+    }
+    if (!(c = calloc(1, sizeof *c)))
+        panic("out of memory");
+    strcpy(c->name, name);
+    c->join = joined;
+    c->idx = nch;
+    c->srv = us;
+    chhash(c);
+    chl[nch] = c;
+    vchan(c); /* Before its backlog. */
+    trx = 0; /* Reloaded lines are not traffic. */
+    ilreload(nch);
+    trx = rx;
+    if (joined)
+        ch = nch;
+    nch++;
+    tdrawbar();
+    return nch;
+}
+
+static int
+chdel(char *name)
+{
+    int n, i;
+
+    if ((n = chfind(name)) == sbuf())
+        return 0;
+    vpart(chl[n]);
+    nch--;
+    chunhash(chl[n]);
+    chfree(chl[n]);
+    free(chl[n]);
+    memmove(&chl[n], &chl[n + 1], (nch - n) * sizeof *chl);
+    for (i = n; i < nch; i++)
+        chl[i]->idx = i;
+    ch = nch - 1;
+    tdrawbar();
+    return 1;
+}
+
+/* Compute where l wraps in the main window, unless already done for
+ * its current width. */
+static void
+lwrap(struct Line *l)
+{
+    unsigned short brk[LineLen];
+    char *p = l->s, *e = p + l->len, *r = p, *q;
+    int x = 0, ww, cw, nb = 0, ind, ascii;
+    size_t n;
+
+    if (l->w == scr.x)
+        return;
+    ind = INDENT < scr.x / 2 ? INDENT : scr.x / 2;
+    ascii = asciilen(p, l->len) == (size_t)l->len;
+#define NEWROW(at)  (brk[nb++] = (r = (at)) - l->s, x = ind)
+    while (p < e) {
+        if (*p == ' ') {
+            if (++x > scr.x && p + 1 < e) /* pushl() drops the space ending a row. */
+                NEWROW(p + 1);
+            p++;
+            continue;
+        }
+        if (ascii) { /* One byte is one column. */
+            if (!(q = memchr(p, ' ', e - p)))
+                q = e;
+            ww = q - p;
+        } else
+            for (q = p, ww = 0; q < e && *q != ' '; q += n, ww += cw)
+                n = runewidth(q, e, &cw);
+        if (x + ww > scr.x && p != r && ww <= scr.x - ind)
+            NEWROW(p);
+        if (ascii && x + ww <= scr.x) {
+            x += ww;
+            p = q;
+            continue;
+        }
+        for (; p < q; p += n) { /* Break words wider than a row. */
+            n = runewidth(p, q, &cw);
+            if (x + cw > scr.x && p != r)
+                NEWROW(p);
+            x += cw;
+        }
+    }
+#undef NEWROW
+    if (nb != l->nbrk) {
+        free(l->brk);
+        l->brk = 0;
+        if (nb && !(l->brk = malloc(nb * sizeof *brk)))
+            panic("out of memory");
+    }
+    if (nb)
+        memcpy(l->brk, brk, nb * sizeof *brk);
+    l->nbrk = nb;
+    l->w = scr.x;
+}
+
+static void
+tnewline(void)
+{
+    if (getcurx(scr.mw)) /* Full rows have already wrapped. */
+        waddch(scr.mw, '\n');
+}
+
+static void
+pushl(struct Line *l)
+{
+    char *p = l->s, *e;
+    int i, ind;
+
+    lwrap(l);
+    ind = INDENT < scr.x / 2 ? INDENT : scr.x / 2;
+    for (i = 0; i <= l->nbrk; i++, p = e) {
+        e = i < l->nbrk ? l->s + l->brk[i] : l->s + l->len;
+        if (i) {
+            tnewline();
+            wprintw(scr.mw, "%*s", ind, "");
+        }
+        waddnstr(scr.mw, p, e - p - (i < l->nbrk && e[-1] == ' ')); /* Not the space it broke at. */
+    }
+}
+
+/* Room for a line at the end of c's scrollback, and in its index. */
+static char *
+pushroom(struct Chan *c)
+{
+    struct Chunk *k = c->tail;
+
+    if (!k || k->len + LineLen > ChunkSz)
+        k = chgrow(c);
+    if (c->line + c->nl == c->lbuf + c->lsz) { /* Compact, or grow, the index. */
+        if (c->nl)
+            memmove(c->lbuf, c->line, c->nl * sizeof *c->line);
+        if (c->nl >= c->lsz / 2) {
+            c->lsz = c->lsz ? c->lsz * 2 : 64;
+            if (!(c->lbuf = realloc(c->lbuf, c->lsz * sizeof *c->lbuf)))
+                panic("out of memory");
+        }
+        c->line = c->lbuf;
+    }
+    return k->buf + k->len;
+}
+
+/* Add the n bytes written where pushroom() said as a line of cn. */
+static void
+pushline(int cn, char *p, size_t n)
+{
+    struct Chan *const c = chl[cn];
+    struct Line *l;
+    char *s, *e;
+
+    if (n > LineLen - 2)
+        n = LineLen - 2;
+    for (s = e = p; e < p + n; e++) /* Control codes are not rendered. */
+        if ((unsigned char)*e >= ' ' && *e != 0x7f)
+            *s++ = *e;
+    n = s - p;
+    p[n] = '\n';
+    c->tail->len += n + 1;
+    l = &c->line[c->nl++];
+    l->s = p;
+    l->len = n;
+    l->w = l->nbrk = 0;
+    l->brk = 0;
+    if (dm.nv)
+        vpush(c, p, n);
+    if (cn == ch && c->n == 0 && scr.mw && !(tdirty & DirtyRedraw)) {
+        tnewline();
+        pushl(l);
+        tdirty |= DirtyMain;
+    }
+}
+
+/* Add a line formatted elsewhere, as it is. */
+static void
+pushs(int cn, const char *s, size_t n)
+{
+    char *p = pushroom(chl[cn]);
+
+    if (n > LineLen - 2)
+        n = LineLen - 2;
+    memcpy(p, s, n);
+    pushline(cn, p, n);
+}
+
+/* Name of c in the logs, in b: with several servers, their channels
+ * are told apart by the host. */
+static const char *
+chlogname(const struct Chan *c, char b[LogName])
+{
+    if (nsrv < 2)
+        return c->name;
+    snprintf(b, LogName, "%.255s/%s", srvs[c->srv].host, c->name); /* Hosts are shorter. */
+    return b;
+}
+
+static void
+pushv(int cn, time_t t, int log, const char *fmt, va_list vl)
+{
+    struct Chan *const c = chl[cn];
+    const struct Stamp *st = stamp(uistamp, t);
+    long long t0 = nsec();
+    char *s, *p, b[LogName];
+    size_t n;
+
+    p = pushroom(c);
+    memcpy(p, st->loc, st->nloc);
+    n = st->nloc;
+    p[n++] = ' ';
+    s = p + n;
+    n += vsnprintf(s, LineLen - n - 1, fmt, vl);
+    if (log && lg.q.q)
+        logpush(chlogname(c, b), t, s, trx);
+    if (trx) {
+        if (cn == ch && dm.mode != ModeDaemon) /* Only what the next frame shows. */
+            latadd(&lat.pend, trx);
+        c->nmsg++;
+    }
+    pushline(cn, p, n);
+    hadd(&stats.h[StPush], nsec() - t0, 1);
+}
+
+static void
+pushf(int cn, const char *fmt, ...)
+{
+    va_list vl;
+
+    va_start(vl, fmt);
+    pushv(cn, tmsg ? tmsg : tnow, 1, fmt, vl);
+    va_end(vl);
+}
+
+static void
+pusht(int cn, time_t t, const char *fmt, ...)
+{
+    va_list vl;
+
+    va_start(vl, fmt);
+    pushv(cn, t, 0, fmt, vl);
+    va_end(vl);
+}
+
+/* Fill channel cn with its last BACKLOG lines from the indexed log,
+ * found through the index of the channel alone. */
+static void
+ilreload(int cn)
+{
+    char b[LogName], m[sizeof(struct IlogRec) + LogName + LineLen], path[32];
+    const char *name = chlogname(chl[cn], b);
+    size_t nl = strlen(name), nx, n, i;
+    struct IlogIdx x[BACKLOG ? BACKLOG : 1];
+    struct IlogRec r;
+    struct stat sx;
+    int lfd, xfd;
+
+    if (!lg.ipath || !BACKLOG)
+        return;
+    pushold = 1;
+    snprintf(path, sizeof path, "%s/%08x", ILOG_CHAN, (unsigned)ilhash(name, nl));
+    lfd = ilopen(ILOG_LOG, O_RDONLY);
+    xfd = ilopen(path, O_RDONLY);
+    if (lfd < 0 || xfd < 0 || fstat(xfd, &sx) < 0)
+        goto out;
+    nx = sx.st_size / sizeof *x;
+    n = nx < BACKLOG ? nx : BACKLOG;
+    if (pread(xfd, x, n * sizeof *x, (nx - n) * sizeof *x) != (ssize_t)(n * sizeof *x))
+        goto out;
+    for (i = 0; i < n; i++) {
+        if (x[i].len < sizeof r || x[i].len > sizeof m
+        || pread(lfd, m, x[i].len, x[i].off) != (ssize_t)x[i].len)
+            continue;
+        memcpy(&r, m, sizeof r);
+        if (sizeof r + r.clen + r.mlen > x[i].len || !ilsame(m + sizeof r, r.clen, name, nl))
+            continue; /* Another channel with the same hash. */
+        pusht(cn, r.t, "%.*s", (int)r.mlen, m + sizeof r + r.clen);
+    }
+out:
+    pushold = 0;
+    if (lfd >= 0)
+        close(lfd);
+    if (xfd >= 0)
+        close(xfd);
+}
+
+char
+*strremove(char *str, const char *sub) {
+    size_t len = strlen(sub);
+    if (len > 0) {
+        char *p = str;
+        size_t size = 0;
+        while ((p = strstr(p, sub)) != NULL) {
+            size = (size == 0) ? (p - str) + strlen(p + len) + 1 : size - len;
+            memmove(p, p + len, size - (p - str));
+        }
+    }
+    return str;
+}
+
+static char *
+musr(struct Msg *m)
+{
+    return m->nick.n ? m->nick.p : "?";
+}
+
+static char *
+mdata(struct Msg *m)
+{
+    return m->trail ? m->par[m->npar - 1].p : 0;
+}
+
+static void
+hprivmsg(struct Msg *m)
+{
+    int c;
+    int pushed = 0;
+    char *usr = musr(m), *data = mdata(m), *chan;
+
+    if (m->npar < 2 || !data)
+        return;
+    if (!strcmp(data, "\001VERSION\001"))
+        sndf("NOTICE %s :\001VERSION %s\001", usr, VERSION);
+    if (strstr(data, "\001PING") != NULL)
+        sndf("NOTICE %s :%s", usr, data);
+    if (strchr("&#!+.~", m->par[0].p[0]))
+        chan = m->par[0].p;
+    else
+        chan = usr;
+    if ((c = chfind(chan)) == sbuf()) {
+        if (chadd(chan, 0) < 0)
+            return;
+        tredraw();
+    }
+    c = chfind(chan);
+    if (strstr(data, "\001ACTION") != NULL) {
+        char *s = strremove(data, "\001ACTION ");
+        pushf(c, AFMT, usr, s);
+        pushed = 1;
+    }
+    if (hlmatch(data)) {
+        pushhl = 1;
+        pushf(c, PFMTHIGH, usr, data);
+        pushhl = 0;
+        pushed = 1;
+        ntfpush(chl[c]->srv, usr, chan, data);
+        chl[c]->high |= ch != c;
+    }
+    if (!pushed) {
+        pushf(c, PFMT, usr, data);
+    }
+    if (ch != c) {
+        chl[c]->new = 1;
+        tdrawbar();
+    }
+}
+
+static void
+hpart(struct Msg *m)
+{
+    if (m->npar)
+        pushf(chfind(m->par[0].p), "! %-12s has left %s", musr(m), m->par[0].p);
+}
+
+static void
+hjoin(struct Msg *m)
+{
+    if (m->npar)
+        pushf(chfind(m->par[0].p), "! %-12s has joined %s", musr(m), m->par[0].p);
+}
+
+static void
+hnick(struct Msg *m)
+{
+    if (!m->npar)
+        return;
+    if (!strcmp(musr(m), nick) && strlen(m->par[0].p) < sizeof nick) {
+        strcpy(nick, m->par[0].p);
+        hlbuild();
+    }
+    pushf(sbuf(), "! %-12s is now known as %s", musr(m), m->par[0].p);
+}
+
+static void
+htopic(struct Msg *m)
+{
+    if (m->npar > 1)
+        pushf(chfind(m->par[0].p), "! %-12s changed the topic to: %s", musr(m), m->par[1].p);
+}
+
+static void
+hkick(struct Msg *m)
+{
+    int c;
+
+    if (m->npar < 2)
+        return;
+    c = chfind(m->par[0].p);
+    if (!strcmp(m->par[1].p, nick))
+        chl[c]->join = 0; /* Do not rejoin on reconnect. */
+    pushf(c, "! %-12s has kicked %s (%s)", musr(m), m->par[1].p,
+        m->npar > 2 ? m->par[2].p : "");
+}
+
+static void
+hmode(struct Msg *m)
+{
+    char par[LineLen], *p = par;
+    int i;
+
+    if (!m->npar)
+        return;
+    *p = 0;
+    for (i = 1; i < m->npar && p < par + sizeof par - 1; i++)
+        p += snprintf(p, par + sizeof par - p, &" %s"[i == 1], m->par[i].p);
+    pushf(chfind(m->par[0].p), "! %-12s sets mode %s", musr(m), par);
+}
+
+static void
+hforward(struct Msg *m) /* Channel forwarding. */
+{
+    int s;
+
+    if (m->npar < 3 || (s = chfind(m->par[1].p)) == sbuf())
+        return;
+    chrename(chl[s], m->par[2].p);
+    tdrawbar();
+}
+
+static void
+hjoinerr(struct Msg *m)
+{
+    if (m->npar > 1) {
+        chdel(m->par[1].p);
+        pushf(sbuf(), "-!- Cannot join channel %s (%s)", m->par[1].p, m->cmd.p);
+        tredraw();
+    }
+}
+
+static void
+htopicis(struct Msg *m)
+{
+    if (m->npar > 2)
+        pushf(chfind(m->par[1].p), "! Topic for %s: %s", m->par[1].p, m->par[2].p);
+}
+
+static void
+hnames(struct Msg *m)
+{
+    if (m->npar > 3)
+        pushf(chfind(m->par[2].p), "! Names on %s: %s", m->par[2].p, m->par[3].p);
+}
+
+static void
+hnotice(struct Msg *m)
+{
+    pushf(sbuf(), "%s", m->trail ? m->par[m->npar - 1].p : "");
+}
+
+static void
+hignore(struct Msg *m)
+{
+    (void)m;
+}
+
+static void
+hdefault(struct Msg *m)
+{
+    char par[LineLen], *p = par, *data = mdata(m);
+    int i;
+
+    *p = 0;
+    for (i = 0; i < m->npar - m->trail && p < par + sizeof par - 1; i++)
+        p += snprintf(p, par + sizeof par - p, &" %s"[!i], m->par[i].p);
+    pushf(sbuf(), "%s - %s %s", m->cmd.p, par, data ? data : "(null)");
+}
+
+/* Numeric replies, indexed by their value. */
+static void (*const numtab[1000])(struct Msg *) = {
+    [332] = htopicis,
+    [353] = hnames,
+    [366] = hignore,
+    [372] = hnotice,
+    [375] = hnotice,
+    [376] = hnotice,
+    [470] = hforward,
+    [471] = hjoinerr,
+    [473] = hjoinerr,
+    [474] = hjoinerr,
+    [475] = hjoinerr,
+};
+
+/* Verbs, and a table of them indexed by vhash() of their name, filled
+ * by verbbuild(). The hash spreads the verbs below, but not every verb
+ * (KILL goes where KICK does, SETNAME where WALLOPS does), so lookups
+ * probe the next slots until an empty one. */
+#define vhash(s, n)  (((unsigned char)(s)[0] * 15 + (unsigned char)(s)[1] * 23 + (n)) & 31)
+
+static const struct Verb {
+    char *name;
+    void (*fn)(struct Msg *);
+} verbs[] = {
+    {"MODE", hmode},
+    {"NICK", hnick},
+    {"QUIT", hignore},
+    {"TOPIC", htopic},
+    {"PART", hpart},
+    {"NOTICE", hnotice},
+    {"JOIN", hjoin},
+    {"PRIVMSG", hprivmsg},
+    {"KICK", hkick},
+};
+static const struct Verb *verbtab[32];
+
+static void
+verbbuild(void)
+{
+    size_t i, h;
+
+    assert(sizeof verbs / sizeof *verbs < 32); /* Probes end on an empty slot. */
+    for (i = 0; i < sizeof verbs / sizeof *verbs; i++) {
+        for (h = vhash(verbs[i].name, strlen(verbs[i].name)); verbtab[h]; h = (h + 1) & 31)
+            ;
+        verbtab[h] = &verbs[i];
+    }
+}
+
+/* The IRCv3 server-time of m, or 0. */
+static time_t
+mtime(const struct Msg *m)
+{
+    static char day[10];
+    static time_t t0;
+    struct tm tm;
+    char v[32];
+
+    if (!m->tags.n || !mtag(m, "time", v, sizeof v) || strlen(v) < 19 || v[10] != 'T')
+        return 0;
+    if (memcmp(v, day, 10)) { /* timegm() once a day. */
+        memset(&tm, 0, sizeof tm);
+        if (!strptime(v, "%Y-%m-%d", &tm))
+            return 0;
+        t0 = timegm(&tm);
+        memcpy(day, v, 10);
+    }
+    return t0 + atoi(v + 11) * 3600 + atoi(v + 14) * 60 + atoi(v + 17);
+}
+
+static void
+scmd(struct Msg *m)
+{
+    char *c = m->cmd.p;
+    size_t n = m->cmd.n;
+    int i;
+
+    if (n == 3 && isdigit((unsigned char)c[0])
+    && isdigit((unsigned char)c[1]) && isdigit((unsigned char)c[2])) {
+        i = (c[0] - '0') * 100 + (c[1] - '0') * 10 + c[2] - '0';
+        (numtab[i] ? numtab[i] : hdefault)(m);
+        return;
+    }
+    if (n > 1)
+        for (i = vhash(c, n); verbtab[i]; i = (i + 1) & 31)
+            if (!strcmp(verbtab[i]->name, c)) {
+                verbtab[i]->fn(m);
+                return;
+            }
+    hdefault(m);
+}
+
+/* Register once the network thread has a link up to server us. */
+static void
+sregister(void)
+{
+    int i;
+
+    if (*srvs[us].pass)
+        sndf("PASS %s", srvs[us].pass);
+    sndf("NICK %s", nick);
+    sndf("USER %s 8 * :%s", user, user);
+    sndf("MODE %s +i", nick);
+    for (i = 0; i < nch; i++)
+        if (chl[i]->join && chl[i]->srv == us)
+            sndf("JOIN %s", chl[i]->name);
+}
+
+/* Handle what the network thread queued. */
+static void
+ndrain(void)
+{
+    struct NetRec *r;
+    struct Msg m;
+    long long t;
+    Span *sp;
+    int i;
+
+    while ((r = rnext(&nt.in))) {
+        us = r->srv;
+        switch (r->kind) {
+        case NetMsg:
+            m.npar = r->npar;
+            m.trail = r->trail;
+            for (i = 0; i < 5 + m.npar; i++) {
+                sp = mspan(&m, i);
+                sp->p = r->data + r->sp[i][0];
+                sp->n = r->sp[i][1];
+            }
+            tmsg = mtime(&m);
+            trx = r->rx;
+            t = nsec();
+            scmd(&m);
+            hadd(&stats.h[StDispatch], nsec() - t, 1);
+            tmsg = trx = 0;
+            break;
+        case NetNote:
+            pushf(sbuf(), "-!- %s", r->data);
+            break;
+        case NetUp:
+            sregister();
+            break;
+        case NetStatus:
+            snprintf(ust[us].st, sizeof ust[us].st, "%s", r->data);
+            vstatus(us);
+            tdrawbar();
+            break;
+        case NetFatal:
+            panic(r->data);
+        case NetLag:
+            ust[us].lag = atoll(r->data);
+            vstatus(us);
+            tdrawbar();
+            break;
+        }
+        rdone(&nt.in, r);
+    }
+}
+
+/* Show the counters in the server buffer. */
+static void
+stshow(void)
+{
+    const struct Hist *h[NStages + 2];
+    const char *name[NStages + 2];
+    long long now = nsec(), d = now - stats.tlast;
+    unsigned long n;
+    int i;
+
+    pusht(sbuf(), tnow, "-!- stats: up %llds, in %lu lines %lu kB, out %lu lines %lu kB, %lu lines from the ui",
+        (now - stats.t0) / 1000000000,
+        __atomic_load_n(&stats.rxl, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.rxb, __ATOMIC_RELAXED) >> 10,
+        __atomic_load_n(&stats.txl, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.txb, __ATOMIC_RELAXED) >> 10, stats.sndl);
+    pusht(sbuf(), tnow, "-!- stats: lag %lldms, send queue %lu B, ui queue %lu B, log queue %lu B (%lu dropped), scrollback %zu kB",
+        ust[us].lag, __atomic_load_n(&stats.outq, __ATOMIC_RELAXED),
+        __atomic_load_n(&nt.in.head, __ATOMIC_RELAXED) - nt.in.tail,
+        lg.q.q ? lg.q.head - __atomic_load_n(&lg.q.tail, __ATOMIC_RELAXED) : 0,
+        lg.drops, memtot >> 10);
+    for (i = 0; i < NStages; i++)
+        h[i] = &stats.h[i], name[i] = stname[i];
+    h[i] = &lat.scr, name[i++] = "to screen";
+    h[i] = &lat.log, name[i++] = "to log";
+    for (i = 0; i < NStages + 2; i++) {
+        if (hpct(h[i], 0, &n) < 0)
+            continue;
+        pusht(sbuf(), tnow, "-!- stats: %-9s %9lu  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f us",
+            name[i], n, hpct(h[i], .5, 0) / 1e3, hpct(h[i], .9, 0) / 1e3,
+            hpct(h[i], .99, 0) / 1e3, hpct(h[i], 1, 0) / 1e3);
+    }
+    for (i = 0; i < nch; i++) {
+        if (!chl[i]->nmsg)
+            continue;
+        pusht(sbuf(), tnow, "-!- stats: %-20s %9lu msgs, %.1f/s", chl[i]->name, chl[i]->nmsg,
+            (chl[i]->nmsg - chl[i]->nlast) / (d / 1e9));
+        chl[i]->nlast = chl[i]->nmsg;
+    }
+    stats.tlast = now;
+}
+
+static void
+jsonstr(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+        if (*s == '"' || *s == '\\' || (unsigned char)*s < ' ')
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, f);
+    fputc('"', f);
+}
+
+/* Dump the counters as one line of JSON to stats.path: sent down it if
+ * it is a UNIX socket, else put in place of the file. */
+static void
+stdump(void)
+{
+    static const double p[] = {.5, .9, .99, 1};
+    static const char *pn[] = {"p50", "p90", "p99", "max"};
+    const struct Hist *h[NStages + 2];
+    const char *name[NStages + 2];
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    char tmp[PATH_MAX], *buf = 0;
+    size_t len = 0;
+    struct stat sb;
+    unsigned long n;
+    long long lag = -1;
+    FILE *f;
+    int i, j, fd;
+
+    stats.dumpt = tnow;
+    for (i = 0; i < nsrv; i++) /* The worst of them. */
+        if (ust[i].lag > lag)
+            lag = ust[i].lag;
+    if (!(f = open_memstream(&buf, &len)))
+        return;
+    fprintf(f, "{\"time\":%lld,\"up\":%lld,\"rx_bytes\":%lu,\"rx_lines\":%lu,"
+        "\"tx_bytes\":%lu,\"tx_lines\":%lu,\"sent_lines\":%lu,\"send_queue\":%lu,"
+        "\"ui_queue\":%lu,\"log_queue\":%lu,\"log_drops\":%lu,\"scrollback\":%zu,\"lag_ms\":%lld,",
+        (long long)tnow, (nsec() - stats.t0) / 1000000000,
+        __atomic_load_n(&stats.rxb, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.rxl, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.txb, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.txl, __ATOMIC_RELAXED), stats.sndl,
+        __atomic_load_n(&stats.outq, __ATOMIC_RELAXED),
+        __atomic_load_n(&nt.in.head, __ATOMIC_RELAXED) - nt.in.tail,
+        lg.q.q ? lg.q.head - __atomic_load_n(&lg.q.tail, __ATOMIC_RELAXED) : 0,
+        lg.drops, memtot, lag);
+    for (i = 0; i < NStages; i++)
+        h[i] = &stats.h[i], name[i] = stname[i];
+    h[i] = &lat.scr, name[i++] = "to_screen";
+    h[i] = &lat.log, name[i++] = "to_log";
+    fputs("\"ns\":{", f);
+    for (i = 0; i < NStages + 2; i++) {
+        hpct(h[i], 0, &n);
+        fprintf(f, "%s\"%s\":{\"n\":%lu", i ? "," : "", name[i], n);
+        for (j = 0; j < 4; j++)
+            fprintf(f, ",\"%s\":%lld", pn[j], n ? hpct(h[i], p[j], 0) : 0);
+        fputc('}', f);
+    }
+    fputs("},\"servers\":[", f);
+    for (i = 0; i < nsrv; i++) {
+        fputs(i ? ",{\"host\":" : "{\"host\":", f);
+        jsonstr(f, srvs[i].host);
+        fputs(",\"status\":", f);
+        jsonstr(f, ust[i].st);
+        fprintf(f, ",\"lag_ms\":%lld}", ust[i].lag);
+    }
+    fputs("],\"msgs\":{", f);
+    for (i = 0; i < nch; i++) {
+        if (i)
+            fputc(',', f);
+        jsonstr(f, chl[i]->name);
+        fprintf(f, ":%lu", chl[i]->nmsg);
+    }
+    fputs("}}\n", f);
+    if (fclose(f))
+        goto out;
+
+    if (!stat(stats.path, &sb) && S_ISSOCK(sb.st_mode)) {
+        snprintf(sa.sun_path, sizeof sa.sun_path, "%s", stats.path);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            goto out;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (!connect(fd, (struct sockaddr *)&sa, sizeof sa))
+            write(fd, buf, len); /* Whoever listens had better keep up. */
+        close(fd);
+    } else {
+        snprintf(tmp, sizeof tmp, "%s.tmp", stats.path);
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+            goto out;
+        if (write(fd, buf, len) == (ssize_t)len)
+            rename(tmp, stats.path);
+        else
+            unlink(tmp);
+        close(fd);
+    }
+out:
+    free(buf);
+}
+
+/* Handle a typed line. Commands go to the server of the current buffer. */
+static void
+uparse(char *m)
+{
+    char *p = m;
+
+    us = chl[ch]->srv;
+    //if (!p[0]|| (p[1] != ' ' && p[1] != 0)) {
+    if (!strncmp("/j", p, 2)) { /* Join channels. */
+        p += 1 + (p[2] == ' ');
+        p = strtok(p, " ");
+        while (p) {
+            if (chadd(p, 1) < 0)
+                break;
+            sndf("JOIN %s", p);
+            p = strtok(0, " ");
+        }
+        tredraw();
+        return;
+    }
+    if (!strncmp("/l", p, 2)) {/* Leave channels. */
+        p += 1 + (p[2] == ' ');
+        if (!*p) {
+            if (ch == sbuf())
+                return; /* Cannot leave server window. */
+            strcat(p, chl[ch]->name);
+        }
+        p = strtok(p, " ");
+        while (p) {
+            if (chdel(p))
+                sndf("PART %s", p);
+            p = strtok(0, " ");
+        }
+        tredraw();
+        return;
+    }
+    if (!strncmp("/q", p, 2)) { /* Private message. */
+        int len = strlen(m);
+        char *temp = (char *) malloc (len * (sizeof(char))), *msg;
+        strcpy(temp, p);
+        temp += 3;
+        char *u = strtok(temp, " ");
+        msg = strtok(NULL, "\0");
+        chadd(u, 1);
+        pushf(chfind(u), PFMT, nick, msg);
+        sndf("PRIVMSG %s :%s", u, msg);
+        tredraw();
+        return;
+    }
+    if (!strncmp("/r", p, 2)) { /* Send raw. */
+        if (p[1])
+            sndf("%s", &p[3]);
+        return;
+    }
+    if (!strcmp("/stats", p)) {
+        stshow();
+        return;
+    }
+    if (!strncmp("/x", p, 2)) {/* Quit. */
+        quit = 1;
+        return;
+    }
+    if (!strncmp("/me", p, 3)) {
+        char *s = strremove(p, "/me");
+        pushf(ch, AFMT, nick, s);
+        sndf("PRIVMSG %s :\001ACTION %s\001", chl[ch]->name, s);
+    }
+    else {
+        if (ch == sbuf())
+            return;
+        m += strspn(m, " ");
+        if (!*m)
+            return;
+        pushf(ch, PFMT, nick, m);
+        sndf("PRIVMSG %s :%s", chl[ch]->name, m);
+        return;
+    }/* Send on current channel. */
+}
+
+/* Daemon mode. Viewers that attach get each buffer with its last
+ * BACKLOG lines from the scrollback, then every change as it happens,
+ * all queued and written as the socket takes it; what they send back is
+ * handled as if typed. */
+
+static void
+vclose(struct Viewer *v)
+{
+    pdrop(&uipl, v->fd);
+    close(v->fd);
+    v->fd = -1;
+}
+
+/* Queue a record for v, and return where its n bytes of data go; they
+ * are p, unless it is 0. */
+static char *
+vput(struct Viewer *v, int kind, int flags, const struct Chan *c, const char *p, size_t n)
+{
+    size_t cl = strlen(c->name);
+    struct VRec r = {sizeof r + cl + n, kind,
+        flags | (c == ust[c->srv].buf ? VServer : 0), c->srv, cl};
+    char *b;
+
+    if (v->fd < 0)
+        return 0;
+    if (v->out.end - v->out.beg + r.len > v->max) { /* Not reading. */
+        vclose(v);
+        return 0;
+    }
+    b = lgrow(&v->out, r.len);
+    memcpy(b, &r, sizeof r);
+    memcpy(b + sizeof r, c->name, cl);
+    if (p && n)
+        memcpy(b + sizeof r + cl, p, n);
+    return b + sizeof r + cl;
+}
+
+static void
+vall(int kind, int flags, const struct Chan *c, const char *p, size_t n)
+{
+    int i;
+
+    for (i = 0; i < dm.nv; i++)
+        vput(&dm.v[i], kind, flags, c, p, n);
+}
+
+static void
+vpush(struct Chan *c, const char *p, size_t n)
+{
+    vall(VLines, (pushhl ? VHigh : 0) | (pushold ? VOld : 0), c, p, n + 1);
+}
+
+static void
+vchan(struct Chan *c)
+{
+    int i, f = c->join ? VJoin : 0;
+
+    for (i = 0; i < dm.nv; i++)
+        vput(&dm.v[i], VChan, f | (&dm.v[i] == dm.cur && c->join ? VFocus : 0), c, 0, 0);
+}
+
+static void
+vpart(struct Chan *c)
+{
+    vall(VPart, 0, c, 0, 0);
+}
+
+static void
+vrename(struct Chan *c, const char *to)
+{
+    vall(VRename, 0, c, to, strlen(to));
+}
+
+/* Lag and status of server s, sent along its buffer's name. */
+static void
+vstatus(int s)
+{
+    char b[96];
+    int n;
+
+    if (!dm.nv)
+        return;
+    n = snprintf(b, sizeof b, "%lld %s", ust[s].lag, ust[s].st);
+    vall(VStatus, 0, ust[s].buf, b, n);
+}
+
+/* Blocking, up to the socket's send timeout. */
+static int
+vwritev(int fd, struct iovec *iov, int n)
+{
+    ssize_t w;
+
+    while (n) {
+        if ((w = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; n && (size_t)w >= iov->iov_len; iov++, n--)
+            w -= iov->iov_len;
+        if (n) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/* Queue buffer c and its backlog for a new viewer. */
+static void
+vbacklog(struct Viewer *v, struct Chan *c)
+{
+    struct Chunk *k, *k0;
+    char *p, *p0, *d;
+    size_t n = 0;
+
+    vput(v, VChan, c->join ? VJoin : 0, c, 0, 0);
+    if (!BACKLOG || !c->nl)
+        return;
+    p0 = c->line[c->nl > BACKLOG ? c->nl - BACKLOG : 0].s;
+    for (k0 = c->head; k0 && (p0 < k0->buf || p0 >= k0->buf + k0->len); k0 = k0->next)
+        ;
+    for (k = k0, p = p0; k; k = k->next, p = k ? k->buf : 0)
+        n += k->buf + k->len - p;
+    if (!(d = vput(v, VLines, VOld, c, 0, n)))
+        return;
+    for (k = k0, p = p0; k; k = k->next, p = k ? k->buf : 0) {
+        memcpy(d, p, k->buf + k->len - p);
+        d += k->buf + k->len - p;
+    }
+}
+
+static void
+vattach(void)
+{
+    struct Viewer *v;
+    int fd, i;
+
+    if ((fd = accept(dm.lfd, 0, 0)) < 0)
+        return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (!(v = realloc(dm.v, (dm.nv + 1) * sizeof *v)))
+        panic("out of memory");
+    dm.v = v;
+    v = &dm.v[dm.nv++];
+    memset(v, 0, sizeof *v);
+    v->fd = fd;
+    v->max = (size_t)-1;
+    for (i = 0; i < nch; i++)
+        vbacklog(v, chl[i]);
+    v->max = v->out.end - v->out.beg + ViewerMax; /* The backlog, and then some. */
+    for (i = 0; i < nsrv; i++)
+        vstatus(i);
+}
+
+/* Handle what a viewer sent. */
+static void
+vread(struct Viewer *v)
+{
+    char b[BufSz], name[ChanLen];
+    struct VRec r;
+    ssize_t n;
+    size_t tl;
+
+    if ((n = read(v->fd, lgrow(&v->in, BufSz), BufSz)) <= 0) {
+        v->in.end -= BufSz;
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            vclose(v);
+        return;
+    }
+    v->in.end -= BufSz - n;
+    while (v->in.end - v->in.beg >= sizeof r) {
+        memcpy(&r, v->in.buf + v->in.beg, sizeof r);
+        if (r.len < sizeof r + r.clen || r.len > sizeof r + ChanLen + BufSz
+        || r.clen >= ChanLen || r.srv >= nsrv) {
+            vclose(v);
+            return;
+        }
+        if (v->in.end - v->in.beg < r.len)
+            break;
+        tl = r.len - sizeof r - r.clen;
+        memcpy(name, v->in.buf + v->in.beg + sizeof r, r.clen);
+        name[r.clen] = 0;
+        memcpy(b, v->in.buf + v->in.beg + sizeof r + r.clen, tl < BufSz ? tl : BufSz - 1);
+        b[tl < BufSz ? tl : BufSz - 1] = 0;
+        lpop(&v->in, r.len);
+        if (r.kind != VInput)
+            continue;
+        dm.cur = v;
+        us = r.srv;
+        ch = chfind(name);
+        uparse(b);
+        dm.cur = 0;
+    }
+}
+
+static void
+vfds(void)
+{
+    int i;
+
+    pwant(&uipl, dm.lfd, EPOLLIN);
+    for (i = 0; i < dm.nv; i++)
+        if (dm.v[i].fd >= 0)
+            pwant(&uipl, dm.v[i].fd, EPOLLIN
+                | (dm.v[i].out.beg != dm.v[i].out.end ? EPOLLOUT : 0));
+}
+
+static void
+vstep(void)
+{
+    struct Viewer *v;
+    ssize_t w;
+    int i;
+
+    /* Whatever is queued is tried, it was likely just added. */
+    for (i = 0; i < dm.nv; i++)
+        if (pready(&uipl, dm.v[i].fd, EPOLLIN))
+            vread(&dm.v[i]);
+    if (pready(&uipl, dm.lfd, EPOLLIN))
+        vattach();
+    for (i = 0; i < dm.nv; i++) {
+        v = &dm.v[i];
+        if (v->fd >= 0 && v->out.beg != v->out.end) {
+            if ((w = write(v->fd, v->out.buf + v->out.beg, v->out.end - v->out.beg)) > 0)
+                lpop(&v->out, w);
+            else if (w < 0 && errno != EAGAIN && errno != EINTR)
+                vclose(v);
+        }
+        if (v->fd < 0) {
+            free(v->in.buf);
+            free(v->out.buf);
+            *v = dm.v[--dm.nv];
+            i--;
         }
-        p += utf8decode(p, u, UtfSz);
-        if ((cl = wcwidth(*u)) >= 0)
-            x += cl;
     }
 }
 
 static void
-pushf(int cn, const char *fmt, ...)
+vlisten(void)
 {
-    struct Chan *const c = &chl[cn];
-    size_t n, blen = c->eol - c->buf;
-    va_list vl;
-    time_t t;
-    char *s;
-    struct tm *tm, *gmtm;
-
-    if (blen + LineLen >= c->sz) {
-        c->sz *= 2;
-        c->buf = realloc(c->buf, c->sz);
-        if (!c->buf)
-            panic("out of memory");
-        c->eol = c->buf + blen;
-    }
-    t = time(0);
-    if (!(tm = localtime(&t)))
-        panic("localtime failed");
-#ifdef DATEFMT
-    n = strftime(c->eol, LineLen, DATEFMT, tm);
-#endif
-    if (!(gmtm = gmtime(&t)))
-        panic("gmtime failed");
-    c->eol[n++] = ' ';
-    va_start(vl, fmt);
-    s = c->eol + n;
-    n += vsnprintf(s, LineLen - n - 1, fmt, vl);
-    va_end(vl);
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    mode_t m;
+    int fd;
 
-    if (logfp) {
-        fprintf(logfp, "%-12.12s\t%04d-%02d-%02dT%02d:%02d:%02dZ\t%s\n",
-            c->name,
-            gmtm->tm_year + 1900, gmtm->tm_mon + 1, gmtm->tm_mday,
-            gmtm->tm_hour, gmtm->tm_min, gmtm->tm_sec, s);
-        fflush(logfp);
-    }
+    if (strlen(dm.path) >= sizeof sa.sun_path)
+        panic("socket path too long");
+    strcpy(sa.sun_path, dm.path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        panic("cannot create socket");
+    if (!connect(fd, (struct sockaddr *)&sa, sizeof sa))
+        panic("a daemon already listens on the socket");
+    close(fd);
+    unlink(dm.path);
+    m = umask(077);
+    if ((dm.lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+    || bind(dm.lfd, (struct sockaddr *)&sa, sizeof sa) < 0
+    || listen(dm.lfd, 8) < 0)
+        panic("cannot listen on socket");
+    umask(m);
+    fcntl(dm.lfd, F_SETFL, O_NONBLOCK);
+}
 
-    strcat(c->eol, "\n");
-    if (n >= LineLen - 1)
-        c->eol += LineLen - 1;
-    else
-        c->eol += n + 1;
-    if (cn == ch && c->n == 0) {
-        char *p = c->eol - n - 1;
+/* Viewer side. */
 
-        if (p != c->buf)
-            waddch(scr.mw, '\n');
-        pushl(p, c->eol - 1);
-        wrefresh(scr.mw);
-    }
-}
+/* Buffer name of server us, opened if new. */
+static int
+achan(const char *name, int flags)
+{
+    int n;
 
-char
-*strremove(char *str, const char *sub) {
-    size_t len = strlen(sub);
-    if (len > 0) {
-        char *p = str;
-        size_t size = 0;
-        while ((p = strstr(p, sub)) != NULL) {
-            size = (size == 0) ? (p - str) + strlen(p + len) + 1 : size - len;
-            memmove(p, p + len, size - (p - str));
-        }
-    }
-    return str;
+    if (flags & VServer && ust[us].buf)
+        return ust[us].buf->idx;
+    if (!(flags & VServer) && (n = chfind(name)) != sbuf())
+        return n;
+    if (chadd(name, 0) < 0)
+        return -1;
+    if (flags & VServer)
+        ust[us].buf = chl[nch - 1];
+    return nch - 1;
 }
 
 static void
-scmd(char *usr, char *cmd, char *par, char *data)
+arec(struct VRec *r, const char *name, char *p, size_t n)
 {
-    int s, c;
-    int pushed = 0;
-    char *pm = strtok(par, " "), *chan;
-    if (!usr)
-        usr = "?";
-    else {
-        char *bang = strchr(usr, '!');
-        if (bang)
-            *bang = 0;
-    }
-    if (!strcmp(cmd, "PRIVMSG")) {
-        if (!strcmp(data, "\001VERSION\001"))
-            sndf("NOTICE %s :\001VERSION %s\001", usr, VERSION);
-        if (strstr(data, "\001PING") != NULL)
-            sndf("NOTICE %s :%s", usr, data);
-        if (!pm || !data)
-            return;
-        if (strchr("&#!+.~", pm[0]))
-            chan = pm;
-        else
-            chan = usr;
-        if (!(c = chfind(chan))) {
-            if (chadd(chan, 0) < 0)
-                return;
-            tredraw();
-        }
-        c = chfind(chan);
-        if (strstr(data, "\001ACTION") != NULL) {
-            char *s = strremove(data, "\001ACTION ");
-            pushf(c, AFMT, usr, s);
-            pushed = 1;
-        }
-        if (strcasestr(data, nick)) {
-            pushf(c, PFMTHIGH, usr, data);
-            pushed = 1;
-            char cmd[256];
-            if (NOTIFY) {
-                /* packs all of notify-send into cmd */
-                snprintf(cmd, sizeof(cmd), "notify-send \"%s @ %s\" \"%s\"", usr, chan, data);
-                system(cmd);
-            }
-            chl[c].high |= ch != c;
-        }
-        if (!pushed) {
-            pushf(c, PFMT, usr, data);
-        }
-        if (ch != c) {
-            chl[c].new = 1;
-            tdrawbar();
-        }
-    } else if (!strcmp(cmd, "PING")) {
-        sndf("PONG :%s", data ? data : "(null)");
-    } else if (!strcmp(cmd, "PART")) {
-        if (!pm)
-            return;
-        pushf(chfind(pm), "! %-12s has left %s", usr, pm);
-    } else if (!strcmp(cmd, "JOIN")) {
-        if (!pm)
-            return;
-        pushf(chfind(pm), "! %-12s has joined %s", usr, pm);
-    } else if (!strcmp(cmd, "470")) { /* Channel forwarding. */
-        char *ch = strtok(0, " "), *fch = strtok(0, " ");
+    char *e;
+    int c;
 
-        if (!ch || !fch || !(s = chfind(ch)))
-            return;
-        chl[s].name[0] = 0;
-        strncat(chl[s].name, fch, ChanLen - 1);
-        tdrawbar();
-    } else if (!strcmp(cmd, "471") || !strcmp(cmd, "473")
-           || !strcmp(cmd, "474") || !strcmp(cmd, "475")) { /* Join error. */
-        if ((pm = strtok(0, " "))) {
-            chdel(pm);
-            pushf(0, "-!- Cannot join channel %s (%s)", pm, cmd);
+    us = r->srv;
+    if (r->kind == VStatus) {
+        ust[us].lag = strtoll(p, &e, 10);
+        snprintf(ust[us].st, sizeof ust[us].st, "%s", e + (*e == ' '));
+    } else if (r->kind == VPart) {
+        if (chdel((char *)name))
             tredraw();
+    } else if ((c = achan(name, r->flags)) >= 0)
+        switch (r->kind) {
+        case VChan:
+            chl[c]->join = r->flags & VJoin;
+            if (r->flags & VFocus) {
+                ch = c;
+                tredraw();
+            }
+            break;
+        case VRename:
+            chrename(chl[c], p);
+            break;
+        case VLines:
+            for (; (e = memchr(p, '\n', n)); n -= e + 1 - p, p = e + 1)
+                pushs(c, p, e - p);
+            if (c != ch && !(r->flags & VOld)) {
+                chl[c]->new = 1;
+                chl[c]->high |= (r->flags & VHigh) != 0;
+            }
+            break;
         }
-    } else if (!strcmp(cmd, "QUIT")) { /* Commands we don't care about. */
-        return;
-    } else if (!strcmp(cmd, "NOTICE") || !strcmp(cmd, "375")
-           || !strcmp(cmd, "372") || !strcmp(cmd, "376")) {
-        pushf(0, "%s", data ? data : "");
-    } else
-        pushf(0, "%s - %s %s", cmd, par, data ? data : "(null)");
+    tdrawbar();
 }
 
+/* Handle what the daemon sent. */
 static void
-uparse(char *m)
+arecv(void)
 {
-    char *p = m;
-    //if (!p[0]|| (p[1] != ' ' && p[1] != 0)) {
-    if (!strncmp("/j", p, 2)) { /* Join channels. */
-        p += 1 + (p[2] == ' ');
-        p = strtok(p, " ");
-        while (p) {
-            if (chadd(p, 1) < 0)
-                break;
-            sndf("JOIN %s", p);
-            p = strtok(0, " ");
-        }
-        tredraw();
-        return;
-    }
-    if (!strncmp("/l", p, 2)) {/* Leave channels. */
-        p += 1 + (p[2] == ' ');
-        if (!*p) {
-            if (ch == 0)
-                return; /* Cannot leave server window. */
-            strcat(p, chl[ch].name);
-        }
-        p = strtok(p, " ");
-        while (p) {
-            if (chdel(p))
-                sndf("PART %s", p);
-            p = strtok(0, " ");
-        }
-        tredraw();
-        return;
-    }
-    if (!strncmp("/q", p, 2)) { /* Private message. */
-        int len = strlen(m);
-        char *temp = (char *) malloc (len * (sizeof(char))), *msg;
-        strcpy(temp, p);
-        temp += 3;
-        char *u = strtok(temp, " ");
-        msg = strtok(NULL, "\0");
-        chadd(u, 1);
-        pushf(chfind(u), PFMT, nick, msg);
-        sndf("PRIVMSG %s :%s", u, msg);
-        tredraw();
-        return;
+    char name[ChanLen], *p;
+    struct VRec r;
+    ssize_t n;
+    size_t tl;
+
+    if ((n = read(dm.fd, lgrow(&dm.in, 65536), 65536)) <= 0) {
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else
+            panic("daemon closed the connection");
     }
-    if (!strncmp("/r", p, 2)) { /* Send raw. */
-        if (p[1])
-            sndf("%s", &p[3]);
-        return;
+    dm.in.end -= 65536 - n;
+    while (dm.in.end - dm.in.beg >= sizeof r) {
+        memcpy(&r, dm.in.buf + dm.in.beg, sizeof r);
+        if (r.srv >= MaxSrv)
+            panic("bad record from the daemon");
+        if (dm.in.end - dm.in.beg < r.len)
+            break;
+        p = dm.in.buf + dm.in.beg + sizeof r;
+        tl = r.len - sizeof r - r.clen;
+        snprintf(name, sizeof name, "%.*s", (int)r.clen, p);
+        p += r.clen;
+        if (r.kind == VRename || r.kind == VStatus) { /* Text, terminate it. */
+            char t[ChanLen + 96];
+
+            snprintf(t, sizeof t, "%.*s", (int)tl, p);
+            arec(&r, name, t, tl);
+        } else
+            arec(&r, name, p, tl);
+        lpop(&dm.in, r.len);
     }
-    if (!strncmp("/x", p, 2)) {/* Quit. */
+}
+
+/* Hand a typed line to the daemon; /x only detaches. */
+static void
+asend(const char *l)
+{
+    struct VRec r = {0, VInput, 0, chl[ch]->srv, strlen(chl[ch]->name)};
+    struct iovec iov[3];
+
+    if (!strncmp(l, "/x", 2)) {
         quit = 1;
         return;
     }
-    if (!strncmp("/me", p, 3)) {
-        char *s = strremove(p, "/me");
-        pushf(ch, AFMT, nick, s);
-        sndf("PRIVMSG %s :\001ACTION %s\001", chl[ch].name, s);
-    }
-    else {
-        if (ch == 0)
-            return;
-        m += strspn(m, " ");
-        if (!*m)
-            return;
-        pushf(ch, PFMT, nick, m);
-        sndf("PRIVMSG %s :%s", chl[ch].name, m);
-        return;
-    }/* Send on current channel. */
+    r.len = sizeof r + r.clen + strlen(l);
+    iov[0].iov_base = &r;
+    iov[0].iov_len = sizeof r;
+    iov[1].iov_base = chl[ch]->name;
+    iov[1].iov_len = r.clen;
+    iov[2].iov_base = (char *)l;
+    iov[2].iov_len = strlen(l);
+    if (vwritev(dm.fd, iov, 3) < 0)
+        panic("daemon closed the connection");
 }
 
 static void
@@ -649,61 +4074,58 @@ tresize(void)
 static void
 tredraw(void)
 {
-    struct Chan *const c = &chl[ch];
-    char *q, *p;
-    int nl = -1;
+    tdirty |= DirtyRedraw;
+}
+
+static void
+tdrawbar(void)
+{
+    tdirty |= DirtyBar;
+}
+
+static void
+tpaintmain(void)
+{
+    struct Chan *const c = chl[ch];
+    int fst, lst;
 
-    if (c->eol == c->buf) {
-        wclear(scr.mw);
-        wrefresh(scr.mw);
+    werase(scr.mw);
+    wmove(scr.mw, 0, 0);
+    if (c->nl == 0)
         return;
+    if (c->n > c->nl - (scr.y - 2))
+        c->n = c->nl > scr.y - 2 ? c->nl - (scr.y - 2) : 0;
+    lst = c->nl - c->n;
+    fst = lst - (scr.y - 2);
+    if (fst < 0)
+        fst = 0;
+    for (; fst < lst; fst++) {
+        tnewline();
+        pushl(&c->line[fst]);
     }
-    p = c->eol - 1;
-    if (c->n) {
-        int i = c->n;
-        for (; p > c->buf; p--)
-            if (*p == '\n' && !i--)
-                break;
-        if (p == c->buf)
-            c->n -= i;
-    }
-    q = p;
-    while (nl < scr.y - 2) {
-        while (*q != '\n' && q > c->buf)
-            q--;
-        nl++;
-        if (q == c->buf)
-            break;
-        q--;
-    }
-    if (q != c->buf)
-        q += 2;
-    wclear(scr.mw);
-    wmove(scr.mw, 0, 0);
-    while (q < p)
-        q = pushl(q, p);
-    wrefresh(scr.mw);
 }
 
 static void
-tdrawbar(void)
+tpaintbar(void)
 {
+    const int sv = chl[ch]->srv;
+    char st[96];
     size_t l;
-    int fst = ch;
+    int fst = ch, n = 0;
 
     for (l = 0; fst > 0 && l < scr.x / 2; fst--)
-        l += strlen(chl[fst].name) + 3;
+        l += strlen(chl[fst]->name) + 3;
 
     werase(scr.sw);
     for (l = 0; fst < nch && l < scr.x; fst++) {
-        char *p = chl[fst].name;
+        char *p = chl[fst]->name;
         if (fst == ch)
             wattron(scr.sw, A_REVERSE);
         waddstr(scr.sw, "  "), l++;
-        if (chl[fst].high) {
+        if (chl[fst]->high) {
             wattron(scr.sw, COLOR_PAIR(2)), l++;
         }
-        else if (chl[fst].new)
+        else if (chl[fst]->new)
             wattron(scr.sw, COLOR_PAIR(3)), l++;
         for (; *p && l < scr.x; p++, l++)
             waddch(scr.sw, *p);
@@ -714,7 +4136,34 @@ tdrawbar(void)
             wattroff(scr.sw, COLOR_PAIR(2));
             wattroff(scr.sw, COLOR_PAIR(3));
     }
-    wrefresh(scr.sw);
+    if (ust[sv].lag >= 0) /* Status of the buffer's server, on the right. */
+        n = snprintf(st, sizeof st, " %s%slag %lldms ", ust[sv].st, *ust[sv].st ? "  " : "", ust[sv].lag);
+    else if (*ust[sv].st)
+        n = snprintf(st, sizeof st, " %s ", ust[sv].st);
+    if (n && l + n < (size_t)scr.x)
+        mvwaddstr(scr.sw, 0, scr.x - n, st);
+}
+
+/* Put everything marked dirty on the terminal in one update. */
+static void
+tflush(void)
+{
+    long long t = nsec();
+
+    if (tdirty & DirtyRedraw)
+        tpaintmain();
+    if (tdirty & DirtyBar)
+        tpaintbar();
+    if (tdirty & (DirtyMain | DirtyRedraw))
+        wnoutrefresh(scr.mw);
+    if (tdirty & DirtyBar)
+        wnoutrefresh(scr.sw);
+    wnoutrefresh(scr.iw); /* Last, so that it gets the cursor. */
+    doupdate();
+    latdone(&lat.pend, &lat.scr);
+    tdirty = 0;
+    lastframe = nsec();
+    hadd(&stats.h[StRender], lastframe - t, 1);
 }
 
 static void
@@ -729,24 +4178,24 @@ tgetch(void)
     switch (c) {
     case CTRL('n'):
         ch = (ch + 1) % nch;
-        chl[ch].high = chl[ch].new = 0;
+        chl[ch]->high = chl[ch]->new = 0;
         tdrawbar();
         tredraw();
         return;
     case CTRL('p'):
         ch = (ch + nch - 1) % nch;
-        chl[ch].high = chl[ch].new = 0;
+        chl[ch]->high = chl[ch]->new = 0;
         tdrawbar();
         tredraw();
         return;
     case KEY_PPAGE:
-        chl[ch].n += SCROLL;
+        chl[ch]->n += SCROLL;
         tredraw();
         return;
     case KEY_NPAGE:
-        chl[ch].n -= SCROLL;
-        if (chl[ch].n < 0)
-            chl[ch].n = 0;
+        chl[ch]->n -= SCROLL;
+        if (chl[ch]->n < 0)
+            chl[ch]->n = 0;
         tredraw();
         return;
     case CTRL('a'):
@@ -805,7 +4254,10 @@ tgetch(void)
         break;
     case '\n':
         l[len] = 0;
-        uparse(l);
+        if (dm.mode == ModeAttach)
+            asend(l);
+        else
+            uparse(l);
         dirty = cu = len = 0;
         break;
     default:
@@ -837,6 +4289,8 @@ mvcur:  wmove(scr.iw, 0, cu - shft);
 static void
 treset(void)
 {
+    if (!stdscr)
+        return;
     if (scr.mw)
         delwin(scr.mw);
     if (scr.sw)
@@ -846,42 +4300,143 @@ treset(void)
     endwin();
 }
 
+static void
+sigquit(int sig)
+{
+    if (sig)
+        quit = 1;
+}
+
+/* Coalesce screen updates into frames: draw now, or shorten t to wake
+ * up for the next frame. */
+static void
+tpace(struct timeval *t)
+{
+    long long d;
+
+    if (winchg)
+        tresize();
+    if (!tdirty)
+        return;
+    if ((d = lastframe + 1000000000 / FPS - nsec()) <= 0)
+        tflush();
+    else
+        t->tv_sec = 0, t->tv_usec = d / 1000;
+}
+
+/* Run as a viewer of the daemon at dm.path. */
+static int
+attach(void)
+{
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+
+    if (strlen(dm.path) >= sizeof sa.sun_path)
+        panic("socket path too long");
+    strcpy(sa.sun_path, dm.path);
+    if ((dm.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+    || connect(dm.fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+        panic("cannot attach to the daemon");
+    tinit();
+    while (!nch) /* Its server buffer comes first. */
+        arecv();
+    while (!quit) {
+        struct timeval t = {.tv_sec = 5};
+        fd_set rfs;
+
+        tpace(&t);
+        FD_ZERO(&rfs);
+        FD_SET(0, &rfs);
+        FD_SET(dm.fd, &rfs);
+        if (select(dm.fd + 1, &rfs, 0, 0, &t) < 0) {
+            if (errno == EINTR)
+                continue;
+            panic("select failed");
+        }
+        tnow = time(0);
+        if (FD_ISSET(dm.fd, &rfs))
+            arecv();
+        if (FD_ISSET(0, &rfs)) {
+            tgetch();
+            tflush();
+        }
+    }
+    close(dm.fd);
+    while (nch--) {
+        chfree(chl[nch]);
+        free(chl[nch]);
+    }
+    free(chl);
+    free(chtab);
+    free(dm.in.buf);
+    treset();
+    return 0;
+}
+
+/* Add a server given as HOST, HOST:PORT or [HOST]:PORT, with a + before
+ * PORT for TLS. The nth one registers with IRCPASS_n if it is set. */
+static void
+sadd(char *spec, const char *port)
+{
+    char *p, v[16];
+
+    if (nsrv == MaxSrv)
+        panic("too many servers");
+    snprintf(v, sizeof v, "IRCPASS_%d", nsrv + 1);
+    srvs[nsrv].pass = (p = getenv(v)) ? p : key;
+    srvs[nsrv].tls = ssl;
+    if (*spec == '[' && (p = strchr(spec, ']'))) {
+        *p++ = 0;
+        spec++;
+        if (*p == ':')
+            port = p + 1;
+    } else if ((p = strchr(spec, ':')) && !strchr(p + 1, ':')) { /* Not a bare IPv6 address. */
+        *p = 0;
+        port = p + 1;
+    }
+    if (*port == '+') {
+        port++;
+        srvs[nsrv].tls = 1;
+    }
+    srvs[nsrv].host = spec;
+    srvs[nsrv++].port = port;
+}
+
+#ifndef BENCH /* bench.c has its own. */
 int
 main(int argc, char *argv[])
 {
-    const char *user = getenv("USER");
+    static char defsrv[] = SRV;
     const char *ircnick = getenv("IRCNICK");
-    char key[128];
-#ifdef PWCMD
-    FILE *fp = popen(PWCMD, "r");
-    if (fp == NULL) {
-        panic("failed to run command");
-    }
-    fgets(key, 128, fp);
-    key[strcspn(key, "\n")] = 0;
-    pclose(fp);
-#else
-    if(getenv("IRCPASS"))
-        strcpy(key, getenv("IRCPASS"));
-    else
-        panic("error: IRCPASS environment variable not set");
-#endif
-    const char *server = SRV;
     const char *port = PORT;
-    char *err;
-    int o, reconn;
+    char *server[MaxSrv], *err, *logpath = 0, *ilogpath = 0;
+    int o, nserver = 0;
 
+    user = getenv("USER");
+    tnow = time(0);
+    stats.t0 = stats.tlast = nsec();
     signal(SIGPIPE, SIG_IGN);
-    while ((o = getopt(argc, argv, "thk:n:u:s:p:l:")) >= 0)
+    while ((o = getopt(argc, argv, "thTk:n:u:s:S:p:l:L:m:D:A:")) >= 0)
         switch (o) {
         case 'h':
         case '?':
         usage:
-            fputs("usage: irc [-n NICK] [-u USER] [-s SERVER] [-p PORT] [-l LOGFILE ] [-t] [-h]\n", stderr);
+            fputs("usage: irc [-n NICK] [-u USER] [-s SERVER[:[+]PORT]]... [-p PORT] [-l LOGFILE ] [-L LOGDIR] [-m MEM[kMG]] [-S STATS] [-D|-A SOCKET] [-t] [-T] [-h]\n", stderr);
             exit(0);
         case 'l':
-            if (!(logfp = fopen(optarg, "a")))
-                panic("fopen: logfile");
+            logpath = optarg;
+            break;
+        case 'L':
+            ilogpath = optarg;
+            break;
+        case 'm':
+            memmax = strtoul(optarg, &err, 10);
+            switch (*err) {
+            case 'G': memmax <<= 10; /* fallthrough */
+            case 'M': memmax <<= 10; /* fallthrough */
+            case 'k': memmax <<= 10; break;
+            case 0: break;
+            default: goto usage;
+            }
             break;
         case 'n':
             if (strlen(optarg) >= sizeof nick)
@@ -891,16 +4446,48 @@ main(int argc, char *argv[])
         case 't':
             ssl = 1;
             break;
+        case 'T':
+            lat.show = 1;
+            break;
         case 'u':
             user = optarg;
             break;
         case 's':
-            server = optarg;
+            if (nserver == MaxSrv)
+                goto usage;
+            server[nserver++] = optarg;
+            break;
+        case 'S':
+            stats.path = optarg;
+            break;
+        case 'D':
+            dm.mode = ModeDaemon;
+            dm.path = optarg;
+            break;
+        case 'A':
+            dm.mode = ModeAttach;
+            dm.path = optarg;
             break;
         case 'p':
             port = optarg;
             break;
         }
+    if (dm.mode == ModeAttach)
+        return attach();
+#ifdef PWCMD
+    FILE *fp = popen(PWCMD, "r");
+    if (fp == NULL) {
+        panic("failed to run command");
+    }
+    fgets(key, 128, fp);
+    key[strcspn(key, "\n")] = 0;
+    pclose(fp);
+#else
+    if(getenv("IRCPASS"))
+        strcpy(key, getenv("IRCPASS"));
+    else
+        panic("error: IRCPASS environment variable not set");
+#endif
     if (!user)
         user = "anonymous";
     if (!nick[0] && ircnick && strlen(ircnick) < sizeof nick)
@@ -909,76 +4496,128 @@ main(int argc, char *argv[])
         strcpy(nick, user);
     if (!nick[0])
         goto usage;
-    tinit();
-    err = dial(server, port);
-    if (err)
-        panic(err);
-    chadd(server, 0);
-    sinit(key, nick, user);
-    reconn = 0;
+    if (!nserver)
+        server[nserver++] = defsrv;
+    for (o = 0; o < nserver; o++) /* After -p, whatever the order. */
+        sadd(server[o], port);
+    if (dm.mode == ModeDaemon) { /* Before any thread is started. */
+        vlisten();
+        if (daemon(1, 0) < 0) /* Let go of the terminal, fds 0-2 too. */
+            panic("cannot detach");
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGINT, sigquit);
+        signal(SIGTERM, sigquit);
+    }
+    if (logpath || ilogpath)
+        loginit(logpath, ilogpath);
+    if (dm.mode != ModeDaemon)
+        tinit();
+    for (us = 0; us < nsrv; us++) {
+        chadd(srvs[us].host, 0);
+        ust[us].buf = chl[nch - 1];
+        strcpy(ust[us].st, "connecting");
+        ust[us].lag = -1;
+    }
+    us = 0;
+    for (o = 0; o < nsrv && !srvs[o].tls; o++)
+        ;
+    if (o < nsrv)
+        sctx();
+    pinit(&uipl);
+    pinit(&nt.pl);
+    rinit(&nt.in, NetRing);
+    rinit(&nt.out, OutRing);
+    if (pipe(nt.wake) < 0 || pipe(nt.uiwake) < 0)
+        panic("cannot create pipe");
+    fcntl(nt.wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(nt.uiwake[1], F_SETFL, O_NONBLOCK);
+    hlinit();
+    igbuild();
+    verbbuild();
+    if (pthread_create(&nt.thr, 0, nthread, 0))
+        panic("cannot start network thread");
+    if (NOTIFY)
+        ntfinit();
     while (!quit) {
         struct timeval t = {.tv_sec = 5};
-        struct Chan *c;
-        fd_set rfs, wfs;
-        int ret;
 
-        if (winchg)
-            tresize();
-        FD_ZERO(&wfs);
-        FD_ZERO(&rfs);
-        FD_SET(0, &rfs);
-        if (!reconn) {
-            FD_SET(srv.fd, &rfs);
-            if (outp != outb)
-                FD_SET(srv.fd, &wfs);
-        }
-        ret = select(srv.fd + 1, &rfs, &wfs, 0, &t);
-        if (ret < 0) {
+        if (dm.mode == ModeDaemon)
+            tdirty = 0; /* Viewers draw for themselves. */
+        else
+            tpace(&t);
+        if (stats.path && t.tv_sec > stats.dumpt + STATSIVL - tnow)
+            t.tv_sec = stats.dumpt + STATSIVL > tnow ? stats.dumpt + STATSIVL - tnow : 0;
+        if (dm.mode != ModeDaemon)
+            pwant(&uipl, 0, EPOLLIN);
+        else
+            vfds();
+        pwant(&uipl, nt.uiwake[0], EPOLLIN);
+        if (pwait(&uipl, t.tv_sec * 1000000000LL + t.tv_usec * 1000LL) < 0) {
             if (errno == EINTR)
                 continue;
-            panic("select failed");
-        }
-        if (reconn) {
-            hangup();
-            if (reconn++ == MaxRecons + 1)
-                panic("link lost");
-            pushf(0, "-!- Link lost, attempting reconnection...");
-            if (dial(server, port) != 0)
-                continue;
-            sinit(key, nick, user);
-            for (c = chl; c < &chl[nch]; ++c)
-                if (c->join)
-                    sndf("JOIN %s", c->name);
-            reconn = 0;
-        }
-        if (FD_ISSET(srv.fd, &rfs)) {
-            if (!srd()) {
-                reconn = 1;
-                continue;
-            }
+            panic("epoll failed");
         }
-        if (FD_ISSET(srv.fd, &wfs)) {
-            int wr;
+        tnow = time(0);
+        if (stats.path && tnow - stats.dumpt >= STATSIVL)
+            stdump();
+        if (pready(&uipl, nt.uiwake[0], EPOLLIN)) {
+            char c[64];
 
-            if (ssl)
-                wr = SSL_write(srv.ssl, outb, outp - outb);
-            else
-                wr = write(srv.fd, outb, outp - outb);
-            if (wr <= 0) {
-                reconn = wr < 0;
-                continue;
-            }
-            outp -= wr;
-            memmove(outb, outb + wr, outp - outb);
+            read(nt.uiwake[0], c, sizeof c);
+            ndrain();
         }
-        if (FD_ISSET(0, &rfs)) {
+        if (dm.mode == ModeDaemon)
+            vstep();
+        else if (pready(&uipl, 0, EPOLLIN)) {
             tgetch();
-            wrefresh(scr.iw);
+            tflush(); /* Keep typing responsive. */
         }
     }
-    hangup();
-    while (nch--)
-        free(chl[nch].buf);
+    __atomic_store_n(&nt.quit, 1, __ATOMIC_RELEASE);
+    write(nt.wake[1], "", 1);
+    pthread_join(nt.thr, 0);
+    for (srv = srvs; srv < srvs + nsrv; srv++) {
+        if (srv->sess)
+            SSL_SESSION_free(srv->sess);
+        for (o = 0; o < NLanes; o++)
+            free(srv->sq.lane[o].buf);
+        free(srv->sq.wire.buf);
+        free(srv->inb.buf);
+    }
+    if (sslctx)
+        SSL_CTX_free(sslctx);
+    pfree(&nt.pl);
+    pfree(&uipl);
+    logstop();
+    ntfstop();
+    while (nch--) {
+        chfree(chl[nch]);
+        free(chl[nch]);
+    }
+    free(chl);
+    free(chtab);
+    free(nt.ovf.buf);
+    acfree(&hlac);
+    acfree(&igac);
+    free(igalways);
+    while (nhlre--)
+        regfree(&hlre[nhlre]);
+    free(hlre);
+    free(nt.in.q);
+    free(nt.out.q);
+    if (dm.mode == ModeDaemon) {
+        while (dm.nv--) {
+            close(dm.v[dm.nv].fd);
+            free(dm.v[dm.nv].in.buf);
+            free(dm.v[dm.nv].out.buf);
+        }
+        free(dm.v);
+        close(dm.lfd);
+        unlink(dm.path);
+    }
     treset();
+    if (lat.show)
+        latreport(stderr);
     exit(0);
 }
+#endif
@@ -0,0 +1,330 @@
+/* Stand-in IRC server for load tests. It serves the commands the client
+ * sends on the loopback and floods every registered client with
+ * timestamped messages at a set rate. */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+enum {
+    MaxCli = 16,
+    LineLen = 512,
+    InSz = 8192,
+    OutMax = 1 << 20, /* Bytes queued to a client before it is behind. */
+};
+
+static struct Cli {
+    int fd;
+    char nick[64];
+    int reg;             /* NICK, then USER, came in. */
+    char in[InSz];
+    size_t nin;
+    char *out;
+    size_t nout, sz;
+    long long t0;        /* When flooding started. */
+    unsigned long sent;  /* Flood lines generated. */
+} cli[MaxCli];
+
+static int rate = 1000, nchan = 10, len = 100, burst = 10, drop;
+static unsigned long count;
+static unsigned long tsent, tbytes, trcvd, tbehind, tconn; /* Since the last report. */
+
+static void
+die(const char *m)
+{
+    fprintf(stderr, "ircload: %s\n", m);
+    exit(1);
+}
+
+static long long
+nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+cprintf(struct Cli *c, const char *fmt, ...)
+{
+    va_list vl;
+    int n;
+
+    if (c->sz - c->nout < LineLen + 2) {
+        c->sz = c->sz ? c->sz * 2 : 65536;
+        if (!(c->out = realloc(c->out, c->sz)))
+            die("out of memory");
+    }
+    va_start(vl, fmt);
+    n = vsnprintf(c->out + c->nout, LineLen - 1, fmt, vl);
+    va_end(vl);
+    if (n > LineLen - 2)
+        n = LineLen - 2;
+    c->out[c->nout + n++] = '\r';
+    c->out[c->nout + n++] = '\n';
+    c->nout += n;
+    tbytes += n;
+}
+
+static void
+cclose(struct Cli *c)
+{
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof *c);
+    c->fd = -1;
+}
+
+static void
+cwrite(struct Cli *c)
+{
+    ssize_t n;
+
+    if (!c->nout)
+        return;
+    if ((n = write(c->fd, c->out, c->nout)) < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            cclose(c);
+        return;
+    }
+    memmove(c->out, c->out + n, c->nout - n);
+    c->nout -= n;
+}
+
+static void
+cjoin(struct Cli *c, const char *chan)
+{
+    cprintf(c, ":%s!load@load.test JOIN %s", c->nick, chan);
+    cprintf(c, ":load.test 353 %s = %s :%s u0 u1 u2", c->nick, chan, c->nick);
+    cprintf(c, ":load.test 366 %s %s :End of /NAMES list.", c->nick, chan);
+}
+
+/* Handle a line from the client, in place. */
+static void
+cline(struct Cli *c, char *l)
+{
+    char *cmd, *arg, *p;
+    int i;
+
+    if (*l == ':' && !(l = strchr(l, ' ')))
+        return;
+    cmd = l + strspn(l, " ");
+    if ((arg = strchr(cmd, ' ')))
+        *arg++ = 0;
+    else
+        arg = "";
+    if (!strcmp(cmd, "PING")) {
+        cprintf(c, ":load.test PONG load.test %s", arg);
+    } else if (!strcmp(cmd, "NICK")) {
+        arg += *arg == ':';
+        if (c->reg == 2)
+            cprintf(c, ":%s!load@load.test NICK :%s", c->nick, arg);
+        snprintf(c->nick, sizeof c->nick, "%s", arg);
+        c->reg += !c->reg;
+    } else if (!strcmp(cmd, "USER") && c->reg == 1) {
+        c->reg = 2;
+        cprintf(c, ":load.test 001 %s :Welcome to the load test", c->nick);
+        cprintf(c, ":load.test 376 %s :End of /MOTD command.", c->nick);
+        for (i = 0; i < nchan; i++) { /* As if forced to join. */
+            char ch[32];
+
+            snprintf(ch, sizeof ch, "#load%d", i);
+            cjoin(c, ch);
+        }
+        c->t0 = nsec();
+    } else if (!strcmp(cmd, "JOIN")) {
+        if ((p = strchr(arg, ' ')))
+            *p = 0;
+        for (p = strtok(arg, ","); p; p = strtok(0, ","))
+            cjoin(c, p);
+    } else if (!strcmp(cmd, "PART")) {
+        if ((p = strchr(arg, ' ')))
+            *p = 0;
+        cprintf(c, ":%s!load@load.test PART %s", c->nick, arg);
+    } else if (!strcmp(cmd, "PRIVMSG") || !strcmp(cmd, "NOTICE")) {
+        trcvd++;
+    } else if (!strcmp(cmd, "QUIT")) {
+        cprintf(c, "ERROR :Closing link");
+        cwrite(c);
+        cclose(c);
+    }
+}
+
+static void
+cread(struct Cli *c)
+{
+    char *l, *s;
+    ssize_t n;
+
+    if ((n = read(c->fd, c->in + c->nin, sizeof c->in - c->nin)) <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            cclose(c);
+        return;
+    }
+    c->nin += n;
+    for (l = c->in; c->fd >= 0 && (s = memchr(l, '\n', c->in + c->nin - l)); l = s + 1) {
+        *s = 0;
+        if (s > l && s[-1] == '\r')
+            s[-1] = 0;
+        cline(c, l);
+    }
+    if (c->fd < 0)
+        return;
+    c->nin -= l - c->in;
+    memmove(c->in, l, c->nin);
+    if (c->nin == sizeof c->in) /* Overlong line. */
+        c->nin = 0;
+}
+
+/* Queue the flood lines due by now, in bursts. Each carries the server
+ * time, a sequence number and the monotonic clock, as sent. */
+static void
+cflood(struct Cli *c, long long now)
+{
+    static char pad[LineLen];
+    unsigned long due;
+    struct timespec ts;
+    struct tm tm;
+    char t[32];
+
+    if (c->reg != 2 || (count && c->sent >= count))
+        return;
+    due = (now - c->t0) / 1000000 * rate / 1000;
+    if (count && due > count)
+        due = count;
+    if (due - c->sent < (unsigned long)burst && due != count)
+        return;
+    if (!*pad)
+        memset(pad, 'x', sizeof pad - 1);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    strftime(t, sizeof t, "%Y-%m-%dT%H:%M:%S", &tm);
+    for (; c->sent < due; c->sent++) {
+        if (c->nout > OutMax) { /* Client is not keeping up. */
+            tbehind += due - c->sent;
+            c->sent = due;
+            break;
+        }
+        cprintf(c, "@time=%s.%03ldZ :u%lu!load@load.test PRIVMSG #load%lu :%lu %lld %.*s",
+            t, ts.tv_nsec / 1000000, c->sent % 100, c->sent % nchan, c->sent,
+            nsec(), len, pad);
+        tsent++;
+    }
+}
+
+static void
+usage(void)
+{
+    fputs("usage: ircload [-p PORT] [-r RATE] [-c CHANNELS] [-l LENGTH] [-b BURST]\n"
+          "               [-n COUNT] [-d DROP]\n"
+          "RATE is messages/s per client, COUNT the messages sent to each, 0\n"
+          "for no end, and DROP the seconds between dropping every client\n", stderr);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_in sa = {0};
+    struct pollfd pfd[MaxCli + 1];
+    long long now, tick, tdrop, next;
+    int o, i, fd, lfd, port = 6667, one = 1, tmo;
+
+    while ((o = getopt(argc, argv, "p:r:c:l:b:n:d:")) >= 0)
+        switch (o) {
+        case 'p': port = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'c': nchan = atoi(optarg); break;
+        case 'l': len = atoi(optarg); break;
+        case 'b': burst = atoi(optarg); break;
+        case 'n': count = strtoul(optarg, 0, 10); break;
+        case 'd': drop = atoi(optarg); break;
+        default: usage();
+        }
+    if (optind != argc || rate <= 0 || nchan <= 0 || burst <= 0 || len < 0)
+        usage();
+    if (len > LineLen - 128)
+        len = LineLen - 128;
+    signal(SIGPIPE, SIG_IGN);
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        die("cannot create socket");
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(lfd, MaxCli) < 0)
+        die("cannot listen");
+    for (i = 0; i < MaxCli; i++)
+        cli[i].fd = -1;
+    fprintf(stderr, "ircload: 127.0.0.1:%d, %d msgs/s over %d channels\n", port, rate, nchan);
+    tick = tdrop = nsec();
+    for (;;) {
+        now = nsec();
+        for (i = 0; i < MaxCli; i++)
+            if (cli[i].fd >= 0) {
+                cflood(&cli[i], now);
+                cwrite(&cli[i]);
+            }
+        if (drop && now - tdrop >= drop * 1000000000LL) {
+            for (i = 0; i < MaxCli; i++)
+                if (cli[i].fd >= 0) {
+                    cclose(&cli[i]);
+                    fputs("ircload: dropped a client\n", stderr);
+                }
+            tdrop = now;
+        }
+        if (now - tick >= 1000000000LL) {
+            fprintf(stderr, "ircload: %lu sent, %lu kB, %lu received, %lu behind, %lu connected\n",
+                tsent, tbytes >> 10, trcvd, tbehind, tconn);
+            tsent = tbytes = trcvd = tbehind = tconn = 0;
+            tick = now;
+        }
+
+        /* Wake up for the next burst, at most 1ms late. */
+        next = burst * 1000000000LL / rate;
+        tmo = next / 1000000 ? next / 1000000 : 1;
+        pfd[MaxCli].fd = lfd;
+        pfd[MaxCli].events = POLLIN;
+        for (i = 0; i < MaxCli; i++) {
+            pfd[i].fd = cli[i].fd;
+            pfd[i].events = POLLIN | (cli[i].nout ? POLLOUT : 0);
+        }
+        if (poll(pfd, MaxCli + 1, tmo) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll failed");
+        }
+        for (i = 0; i < MaxCli; i++) {
+            if (cli[i].fd < 0)
+                continue;
+            if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                cread(&cli[i]);
+            if (cli[i].fd >= 0 && pfd[i].revents & POLLOUT)
+                cwrite(&cli[i]);
+        }
+        if (pfd[MaxCli].revents & POLLIN && (fd = accept(lfd, 0, 0)) >= 0) {
+            for (i = 0; i < MaxCli && cli[i].fd >= 0; i++)
+                ;
+            if (i == MaxCli) {
+                close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            cli[i].fd = fd;
+            tconn++;
+        }
+    }
+}
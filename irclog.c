@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ilog.h"
+
+static void
+die(const char *m)
+{
+    fprintf(stderr, "irclog: %s\n", m);
+    exit(1);
+}
+
+static void
+usage(void)
+{
+    fputs("usage: irclog [-c CHANNEL] [-f FROM] [-t TO] LOGDIR\n"
+          "FROM and TO are UTC times as YYYY-MM-DD[THH:MM[:SS]] or @EPOCH\n", stderr);
+    exit(1);
+}
+
+static int64_t
+ptime(const char *s)
+{
+    struct tm tm;
+    char *e;
+
+    if (*s == '@')
+        return strtoll(s + 1, 0, 10);
+    memset(&tm, 0, sizeof tm);
+    if (!(e = strptime(s, "%Y-%m-%d", &tm)))
+        usage();
+    if (*e == 'T' && !(e = strptime(e + 1, "%H:%M", &tm)))
+        usage();
+    if (*e == ':' && !(e = strptime(e + 1, "%S", &tm)))
+        usage();
+    if (*e)
+        usage();
+    return timegm(&tm);
+}
+
+static void *
+map(const char *dir, const char *name, size_t *sz)
+{
+    char path[4096];
+    struct stat st;
+    void *m;
+    int fd;
+
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        die("cannot open log");
+    *sz = st.st_size;
+    if (!*sz) {
+        close(fd);
+        return 0;
+    }
+    if ((m = mmap(0, *sz, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        die("cannot map log");
+    close(fd);
+    return m;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    const char *chan = 0;
+    struct IlogIdx *x;
+    struct IlogRec r;
+    struct tm tm;
+    size_t lsz, xsz, nx, lo, hi, m, cl = 0;
+    uint32_t h = 0;
+    char *l, *name;
+    time_t t;
+    int o;
+
+    while ((o = getopt(argc, argv, "c:f:t:")) >= 0)
+        switch (o) {
+        case 'c':
+            chan = optarg;
+            cl = strlen(chan);
+            h = ilhash(chan, cl);
+            break;
+        case 'f':
+            from = ptime(optarg);
+            break;
+        case 't':
+            to = ptime(optarg);
+            break;
+        default:
+            usage();
+        }
+    if (optind != argc - 1)
+        usage();
+    l = map(argv[optind], ILOG_LOG, &lsz);
+    x = map(argv[optind], ILOG_IDX, &xsz);
+    nx = xsz / sizeof *x;
+
+    /* The index is stamped with when records were logged, so it is sorted. */
+    for (lo = 0, hi = nx; lo < hi;) {
+        m = lo + (hi - lo) / 2;
+        if (x[m].t < from)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    for (; lo < nx && x[lo].t <= to; lo++) {
+        if ((chan && x[lo].chan != h) || x[lo].len < sizeof r || x[lo].off + x[lo].len > lsz)
+            continue;
+        memcpy(&r, l + x[lo].off, sizeof r); /* Records are packed, unaligned. */
+        if (sizeof r + r.clen + r.mlen > x[lo].len)
+            continue;
+        name = l + x[lo].off + sizeof r;
+        if (chan && !ilsame(name, r.clen, chan, cl))
+            continue;
+        t = r.t;
+        gmtime_r(&t, &tm);
+        printf("%-12.*s\t%04d-%02d-%02dT%02d:%02d:%02dZ\t%.*s\n",
+            r.clen < 12 ? (int)r.clen : 12, name,
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec, (int)r.mlen, name + r.clen);
+    }
+    return 0;
+}